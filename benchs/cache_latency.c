@@ -37,7 +37,7 @@ int main(int argc, char *argv[])
 	struct ccontrol_zone *z;
 	color_set c;
 	assert(argc == 3);
-	size_t zone_size = size *sizeof(struct elem) + 64;
+	size_t zone_size = ccontrol_memsize2zonesize(1,size*sizeof(struct elem));
 
 	/* use the first colors */
 	COLOR_ZERO(&c);
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ccontrol.h>
+
+/* measures the time it takes to create and destroy colored zones:
+ * zones are created and destroyed one at a time, then all at once
+ * with the batched calls.
+ */
+
+static long long int elapsed(struct timespec *start, struct timespec *stop)
+{
+	return (stop->tv_nsec - start->tv_nsec) +
+		1e9* (stop->tv_sec - start->tv_sec);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i,j,nb,iter,ncolors;
+	size_t size;
+	struct timespec start;
+	struct timespec stop;
+	long long int single = 0, batch = 0;
+	assert(argc == 5);
+
+	/* number of zones, size of each zone, number of colors, iterations */
+	nb = atoi(argv[1]);
+	assert(nb > 0 && nb <= IOCTL_MAX_BATCH);
+	assert(ccontrol_str2size(&size,argv[2]) == 0);
+	ncolors = atoi(argv[3]);
+	iter = atoi(argv[4]);
+	assert(iter > 0);
+
+	struct ccontrol_zone *z[IOCTL_MAX_BATCH];
+	color_set c[IOCTL_MAX_BATCH];
+	size_t sizes[IOCTL_MAX_BATCH];
+	for(i = 0; i < nb; i++)
+	{
+		z[i] = ccontrol_new();
+		assert(z[i] != NULL);
+		/* use the first colors */
+		COLOR_ZERO(&c[i]);
+		for(j = 0; j < ncolors; j++)
+			COLOR_SET(j,&c[i]);
+		sizes[i] = size;
+	}
+
+	for(j = 0; j < iter; j++)
+	{
+		clock_gettime(CLOCK_REALTIME, &start);
+		for(i = 0; i < nb; i++)
+			assert(ccontrol_create_zone(z[i],&c[i],size) == 0);
+		for(i = 0; i < nb; i++)
+			assert(ccontrol_destroy_zone(z[i]) == 0);
+		clock_gettime(CLOCK_REALTIME, &stop);
+		single += elapsed(&start,&stop);
+
+		clock_gettime(CLOCK_REALTIME, &start);
+		assert(ccontrol_create_zones(z,c,sizes,0,nb) == 0);
+		assert(ccontrol_destroy_zones(z,nb) == 0);
+		clock_gettime(CLOCK_REALTIME, &stop);
+		batch += elapsed(&start,&stop);
+	}
+	ccontrol_release();
+	for(i = 0; i < nb; i++)
+		ccontrol_delete(z[i]);
+	/* average time to create and destroy a single zone */
+	printf("%u %zu %lld %lld\n", nb, size, single/(iter*nb), batch/(iter*nb));
+	return 0;
+}
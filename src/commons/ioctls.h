@@ -11,6 +11,17 @@
 /* ioctl codes availables in ccontrol:
  * IOCTL_NEW: creates a new device, given a size in pages and a colorset
  * IOCTL_FREE: destroy a device, its memory is given back to the kernel module.
+ * IOCTL_NEW_BATCH, IOCTL_FREE_BATCH: same as above, on several devices.
+ * IOCTL_FAULT_AROUND: on a colored device, sets the number of pages mapped
+ * on each page fault.
+ * IOCTL_NEW_FD: creates a new colored region, given a size and a colorset,
+ * without any device: the region is mapped from the returned file
+ * descriptor, and freed when it is closed and unmapped.
+ * IOCTL_COLORS: on a colored device, gives the color of each of its pages.
+ * IOCTL_GROW: on a colored device, adds pages of the same colors to it.
+ * IOCTL_COLOR_FUNC: gives the function computing the color of a page.
+ * IOCTL_RESERVE: reserves more memory for the module, while devices live.
+ * IOCTL_RELEASE: gives back memory no device uses to the kernel.
  */
 
 #ifndef IOCTLS_H
@@ -22,19 +33,104 @@
 #define MAJOR_NUM 250
 
 /* the data structure passed to ioctl:
- * - _new: contains size and colorset on input
+ * - _new: contains size, flags, node and colorset on input
  *         dev on output
  * - free: contains dev on input
+ * - grow: contains the size to add on input
+ * - new_fd: contains size, flags, node and colorset on input
+ *           fd on output
  */
 
 typedef struct cc_args {
 	int major;
 	int minor;
+	int fd;
+	int flags;
+	int node;
 	size_t size;
 	color_set c;
 } ioctl_args;
 
+/* node the pages of a device come from, or:
+ * ANY: the node of the caller first, then any other one.
+ * LOCAL: only the node of the caller (ANY if it has no memory).
+ */
+#define IOCTL_NODE_ANY -1
+#define IOCTL_NODE_LOCAL -2
+
+/* device flags:
+ * POPULATE: all the pages are mapped at mmap time, instead of one
+ * page fault at a time.
+ */
+#define IOCTL_FLAG_POPULATE 1
+
 #define IOCTL_NEW _IOWR(MAJOR_NUM,0,ioctl_args *)
 #define IOCTL_FREE _IOR(MAJOR_NUM,0,ioctl_args *)
 
+/* the data structure passed to the colors ioctl:
+ * - nbpages: size of the colors array on input,
+ *            number of pages in the device on output
+ * - colors: filled with the color of each page, in mmap order
+ */
+typedef struct cc_colors {
+	size_t nbpages;
+	unsigned int *colors;
+} ioctl_colors;
+
+#define IOCTL_COLORS _IOWR(MAJOR_NUM,1,ioctl_colors *)
+#define IOCTL_GROW _IOW(MAJOR_NUM,2,ioctl_args *)
+
+/* the data structure passed to batched ioctls:
+ * an array of count ioctl_args, each one used as by the simple ioctl.
+ * A batched creation either creates all devices or none.
+ */
+#define IOCTL_MAX_BATCH 64
+typedef struct cc_batch {
+	unsigned int count;
+	ioctl_args *args;
+} ioctl_batch;
+
+#define IOCTL_NEW_BATCH _IOWR(MAJOR_NUM,3,ioctl_batch *)
+#define IOCTL_FREE_BATCH _IOW(MAJOR_NUM,4,ioctl_batch *)
+#define IOCTL_NEW_FD _IOWR(MAJOR_NUM,5,ioctl_args *)
+/* the argument is the number of pages itself */
+#define IOCTL_FAULT_AROUND _IO(MAJOR_NUM,6)
+
+/* functions giving the color of a page, from its page frame number:
+ * MOD: pfn modulo the number of colors.
+ * BITS: the bits of pfn selected by a mask, packed together.
+ * XOR: bit i of the color is the parity of the bits of pfn selected
+ * by mask i (slice hashing).
+ */
+#define IOCTL_COLOR_MOD 0
+#define IOCTL_COLOR_BITS 1
+#define IOCTL_COLOR_XOR 2
+#define IOCTL_MAX_COLOR_MASKS 10
+
+/* the data structure passed to the color function ioctl:
+ * the function, the number of colors, and the masks it uses.
+ */
+typedef struct cc_colorfn {
+	int func;
+	unsigned int colors;
+	unsigned int nbmasks;
+	unsigned long masks[IOCTL_MAX_COLOR_MASKS];
+} ioctl_colorfn;
+
+#define IOCTL_COLOR_FUNC _IOR(MAJOR_NUM,7,ioctl_colorfn *)
+
+/* the data structure passed to the reserve and release ioctls:
+ * - node: the node to resize, IOCTL_NODE_ANY to split the size between
+ *         all nodes.
+ * - size: the memory to add or remove on input (rounded up to the
+ *         blocks of the module), what was really done on output.
+ */
+typedef struct cc_resize {
+	int node;
+	size_t size;
+} ioctl_resize;
+
+#define IOCTL_RESERVE _IOWR(MAJOR_NUM,8,ioctl_resize *)
+#define IOCTL_RELEASE _IOWR(MAJOR_NUM,9,ioctl_resize *)
+
 #endif /* IOCTLS_H */
@@ -11,31 +11,85 @@
 #include"freelist.h"
 #include"ioctls.h"
 
+#include<ctype.h>
 #include<fcntl.h>
+#include<pthread.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<string.h>
 #include<sys/ioctl.h>
 #include<sys/mman.h>
 #include<sys/types.h>
 #include<sys/stat.h>
+#include<sys/sysmacros.h>
 #include<unistd.h>
 #include<errno.h>
 
+/* address space reserved for growable zones, they cannot grow
+ * further */
+#define ZONE_GROW_RESERVE (sizeof(void *) > 4 ? ((size_t)1 << 36) : ((size_t)1 << 28))
+
 #define DEVICE_NAMELENGTH 80
 #define DEVICE_NAMEPREFIX MODULE_CONTROL_DEVICE
-/* this library could possibly be made faster if it wasn't opening the control
- * device each time you want to create a zone.
+
+/* thread-safe zones:
+ * the zone itself is protected by a lock, but each thread keeps a
+ * small cache of the blocks it recently freed, one list per small size
+ * class. Allocations and frees of small blocks hit this cache
+ * without taking the lock most of the time.
+ * A thread cache is attached to a single zone at a time: the last
+ * thread-safe zone the thread allocated from. Cached blocks are still allocated
+ * from the point of view of the zone, they are given back on thread
+ * exit or when the thread switches to another zone.
+ * Destroying a zone empties the caches of all threads: each cache has
+ * its own lock, almost never contended, its owner takes it around each
+ * use. Links between caches and zones are protected by caches_lock.
+ * Locks are taken in this order: caches_lock, zone lock, cache lock.
  */
+#define CACHE_DEPTH 32
+
+struct ccontrol_cache {
+	pthread_mutex_t lock; /* protects the cache against zone destruction */
+	struct ccontrol_zone *z; /* the zone the cached blocks come from */
+	struct ccontrol_cache *next; /* other caches attached to the zone */
+	void *blocks[FL_SMALLBINS]; /* cached blocks, linked by their first word */
+	unsigned int count[FL_SMALLBINS];
+	int registered; /* thread exit cleanup installed */
+};
 
 struct ccontrol_zone {
 	int fd; /* the file description associated with the mmap */
 	void *p; /* the pointer to the beginning of the mmap */
 	size_t size; /* the size of the mmap */
-	dev_t dev; /* the device number of the zone */
+	dev_t dev; /* the device number of the zone, 0 for anonymous ones */
+	int flags; /* creation flags */
+	pthread_mutex_t lock; /* protects the freelist of thread-safe zones */
+	struct ccontrol_cache *caches; /* thread caches attached to the zone, see caches_lock */
+	size_t top; /* arena zones: offset of the first unused byte */
+	size_t last; /* arena zones: offset of the last allocation */
+	unsigned int *colors; /* color of each page, asked to the module on first use */
+	size_t nbpages; /* number of pages in colors */
+	size_t reserved; /* address space reserved for the zone */
+	size_t chunk; /* growable zones: minimum growth */
+	size_t maxrun; /* hugetlb zones with holes: longest run of usable pages */
 };
 
 /* needed by libc_bypass code */
-struct ccontrol_zone local_zone = { -1, NULL, 0, 0};
+struct ccontrol_zone local_zone = { -1, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0, 0, 0, 0};
+/* per-thread zones of libc_bypass, cannot be allocated with malloc */
+static struct ccontrol_zone thread_zones[CCONTROL_MAX_THREAD_ZONES];
+
+struct ccontrol_zone *local_thread_zone(unsigned int i)
+{
+	if(i >= CCONTROL_MAX_THREAD_ZONES)
+		return NULL;
+	return &thread_zones[i];
+}
+
+static __thread struct ccontrol_cache thread_cache = { PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
 
 struct ccontrol_zone * ccontrol_new(void)
 {
@@ -46,156 +100,1206 @@ struct ccontrol_zone * ccontrol_new(void)
 	z->fd = -1;
 	z->p = NULL;
 	z->size = 0;
+	z->flags = 0;
+	z->caches = NULL;
+	z->colors = NULL;
+	z->nbpages = 0;
+	pthread_mutex_init(&z->lock,NULL);
 	return z;
 }
 
 void ccontrol_delete(struct ccontrol_zone *p)
 {
+	if(p == NULL)
+		return;
+	pthread_mutex_destroy(&p->lock);
 	free(p);
 }
 
 size_t ccontrol_memsize2zonesize(unsigned int nballoc, size_t memsize)
 {
-	return memsize + ALLOCATOR_OVERHEAD + HEADER_SIZE*(nballoc-1);
+	/* each allocation is rounded up to a valid block size, the
+	 * zone size might not be aligned either */
+	return memsize + ALLOCATOR_OVERHEAD + ALIGN_MASK + (FL_MINSIZE-1)*nballoc;
 }
 
 int ccontrol_create_zone(struct ccontrol_zone *z, color_set *c, size_t size)
 {
-	int fd_cc,err = 0;
-	ioctl_args io_args;
-	char filename[DEVICE_NAMELENGTH];
-	dev_t dev;
-	if(z == NULL || c == NULL)
-		return 1;
-	/* open the module control device */
-	fd_cc = open(MODULE_CONTROL_DEVICE, O_RDWR | O_NONBLOCK);
-	if(fd_cc == -1)
+	return ccontrol_create_zone_flags(z,c,size,0);
+}
+
+/* the module control device is opened on first use and kept open,
+ * see ccontrol_release */
+static int control_fd = -1;
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int control_get(void)
+{
+	int fd;
+	pthread_mutex_lock(&control_lock);
+	if(control_fd == -1)
 	{
-		perror("module control device open:");
+		control_fd = open(MODULE_CONTROL_DEVICE, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if(control_fd == -1)
+			perror("module control device open:");
+	}
+	fd = control_fd;
+	pthread_mutex_unlock(&control_lock);
+	return fd;
+}
+
+void ccontrol_release(void)
+{
+	pthread_mutex_lock(&control_lock);
+	if(control_fd != -1)
+		close(control_fd);
+	control_fd = -1;
+	pthread_mutex_unlock(&control_lock);
+}
+
+/* fields of a zone mapped at z->p */
+static void zone_setup(struct ccontrol_zone *z, int fd, size_t size, size_t reserved,
+		int flags)
+{
+	z->fd = fd;
+	z->size = size;
+	z->dev = 0;
+	z->flags = flags;
+	z->caches = NULL;
+	z->top = 0;
+	z->last = size;
+	z->colors = NULL;
+	z->nbpages = 0;
+	z->reserved = reserved;
+	z->chunk = size;
+	z->maxrun = 0;
+	if(flags & CCONTROL_ZONE_THREADSAFE)
+		pthread_mutex_init(&z->lock,NULL);
+}
+
+/* mmap a colored region from fd and initialize the zone.
+ * On error, fd is left open.
+ */
+static int zone_map(struct ccontrol_zone *z, int fd, size_t size, int flags)
+{
+	int err = 0;
+	void *base = NULL;
+	size_t pgsize,reserved = size;
+	/* growable zones: reserve address space to grow in, the zone
+	 * must end on a page */
+	if(flags & CCONTROL_ZONE_GROW)
+	{
+		pgsize = sysconf(_SC_PAGESIZE);
+		size = (size + pgsize -1) & ~(pgsize -1);
+		reserved = size > ZONE_GROW_RESERVE ? size : ZONE_GROW_RESERVE;
+		base = mmap(NULL,reserved,PROT_NONE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,-1,0);
+		if(base == MAP_FAILED)
+		{
+			perror("zone address space mmap:");
+			return 1;
+		}
+	}
+	z->p = mmap(base,size,PROT_READ | PROT_WRITE, MAP_SHARED | (base ? MAP_FIXED : 0), fd,0);
+	if(z->p == MAP_FAILED)
+	{
+		perror("module color device mmap:");
+		if(base != NULL)
+			munmap(base,reserved);
+		z->p = NULL;
 		return 1;
 	}
-	/* tell him to create a new zone */
-	io_args.size = size;
-	io_args.c = *c;
-	err = ioctl(fd_cc,IOCTL_NEW,&io_args);
-	if(err == -1)
+	/* initialize the freelist, arenas do not need one */
+	if(!(flags & CCONTROL_ZONE_ARENA))
+		err = fl_init(z->p,size);
+	if(err)
 	{
-		perror("module control device ioctl:");
-		err = 1;
-		goto close_control;
+		fprintf(stderr,"module color device: zone too small for the allocator\n");
+		munmap(z->p,reserved);
+		z->p = NULL;
+		return 1;
 	}
-	/* on succes, we need to create the device and mmap to it */
+	zone_setup(z,fd,size,reserved,flags);
+	return 0;
+}
+
+/* once the module created a device, we need to create its node and
+ * mmap to it. On error, the device is left for the caller to free.
+ */
+static int zone_attach(struct ccontrol_zone *z, ioctl_args *io_args, size_t size,
+		int flags)
+{
+	int fd,err = 0;
+	char filename[DEVICE_NAMELENGTH];
+	dev_t dev;
 	/* create a name */
-	snprintf(filename,DEVICE_NAMELENGTH,"%s%d",DEVICE_NAMEPREFIX,io_args.minor);
-	dev = makedev(io_args.major,io_args.minor);
+	snprintf(filename,DEVICE_NAMELENGTH,"%s%d",DEVICE_NAMEPREFIX,io_args->minor);
+	dev = makedev(io_args->major,io_args->minor);
 	err = mknod(filename,S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP,dev);
 	if(err == -1)
 	{
 		perror("module color device mknod:");
-		err = 1;
-		goto clean_ioctl;
+		return 1;
 	}
-	z->fd = open(filename,O_RDWR);
-	if(z->fd == -1)
+	fd = open(filename,O_RDWR);
+	if(fd == -1)
 	{
 		perror("module color device open:");
 		err = 1;
 		goto clean_node;
 	}
-	z->p = mmap(NULL,size,PROT_READ | PROT_WRITE, MAP_SHARED, z->fd,0);
-	if(z->p == MAP_FAILED)
-	{
-		perror("module color device mmap:");
-		err = 1;
+	err = zone_map(z,fd,size,flags);
+	if(err)
 		goto close_color;
-	}
-	/* initialize the freelist */
-	fl_init(z->p,size);
-	z->size = size;
 	z->dev = dev;
-	err = 0;
-	goto close_control;
+	return 0;
 
 close_color:
-	close(z->fd);
+	close(fd);
 clean_node:
 	unlink(filename);
-clean_ioctl:
-	/* if something went wrong after ioctl, we need to tell the kernel to destroy
-	 * the new device
-	 */
-	ioctl(fd_cc,IOCTL_FREE,&io_args);
-close_control:
-	close(fd_cc);
-
 	return err;
 }
 
-/* this function destroys a zone and its associated device.
+/* undo zone_attach, io_args is set to the device to free.
+ * Anonymous zones are freed by the module once closed.
  * Since most errors are unrecoverable, we just fall through
  * each error code, trying to clean everything whatever happens.
  */
-int ccontrol_destroy_zone(struct ccontrol_zone *z)
+static int zone_detach(struct ccontrol_zone *z, ioctl_args *io_args)
 {
-	int fd_cc,err = 0;
-	ioctl_args io_args;
+	int err = 0;
 	char filename[DEVICE_NAMELENGTH];
-	if(z == NULL)
-		return 1;
+	/* cached blocks die with the zone */
+	if(z->flags & CCONTROL_ZONE_THREADSAFE)
+	{
+		struct ccontrol_cache *c;
+		pthread_mutex_lock(&caches_lock);
+		pthread_mutex_lock(&z->lock);
+		for(c = z->caches; c != NULL; c = c->next)
+		{
+			pthread_mutex_lock(&c->lock);
+			c->z = NULL;
+			memset(c->blocks,0,sizeof(c->blocks));
+			memset(c->count,0,sizeof(c->count));
+			pthread_mutex_unlock(&c->lock);
+		}
+		z->caches = NULL;
+		pthread_mutex_unlock(&z->lock);
+		pthread_mutex_unlock(&caches_lock);
+	}
+	if(z->colors != NULL)
+		munmap(z->colors,z->nbpages*sizeof(unsigned int));
+	z->colors = NULL;
+	z->nbpages = 0;
 	/* unmap the device */
-	err = munmap(z->p,z->size);
-	if(err == -1)
+	if(munmap(z->p,z->reserved) == -1)
+	{
 		perror("module color device munmap:");
-	/* close the device */
-	err = close(z->fd);
-	if(err == -1)
-		perror("module color device close:");
-	/* open the module control device */
-	fd_cc = open(MODULE_CONTROL_DEVICE, O_RDWR | O_NONBLOCK);
-	if(fd_cc == -1)
+		err = 1;
+	}
+	z->p = NULL;
+	/* close the device, hugetlb zones have none */
+	if(z->fd != -1 && close(z->fd) == -1)
 	{
-		perror("module control device open:");
-		return 1;
+		perror("module color device close:");
+		err = 1;
 	}
+	if(z->dev == 0)
+		return err;
 	/* create a name */
 	snprintf(filename,DEVICE_NAMELENGTH,"%s%d",DEVICE_NAMEPREFIX,minor(z->dev));
 	/* unlink it */
 	unlink(filename);
-	/* now destroy the device */
-	io_args.major = major(z->dev);
-	io_args.minor = minor(z->dev);
-	err = ioctl(fd_cc,IOCTL_FREE,&io_args);
+	io_args->major = major(z->dev);
+	io_args->minor = minor(z->dev);
+	return err;
+}
+
+/* hugetlb backend:
+ * without the module, zones are made of huge pages. A huge page is
+ * physically contiguous, so the color of each of its small pages
+ * follows from its place in the huge page, and from the physical
+ * address of the huge page if the number of colors does not divide its
+ * number of small pages.
+ * Small pages cannot be unmapped from a huge page: pages of other
+ * colors stay in the zone, as holes the allocator never uses. An
+ * allocation cannot be bigger than the longest run of pages of the zone
+ * colors, contiguous color sets work best. The first allocation failing
+ * for that reason prints a warning.
+ * The color function is the one of the module if it is loaded, pfn
+ * modulo the number of colors otherwise.
+ * This code runs under malloc (libc_bypass): it does not allocate, but
+ * reports errors on stderr with the unbuffered stdio functions.
+ */
+#define HUGE_SYSCACHE "/sys/devices/system/cpu/cpu0/cache/index"
+#define HUGE_MAXINDEX 16
+
+static int zone_hugetlb(int flags)
+{
+	char *env;
+	if(flags & CCONTROL_ZONE_HUGETLB)
+		return 1;
+	env = getenv(CCONTROL_ENV_BACKEND);
+	return env != NULL && !strcmp(env,"hugetlb");
+}
+
+/* reads the beginning of a file in buf, as a string */
+static int read_file(const char *path, char *buf, size_t len)
+{
+	int fd;
+	ssize_t r;
+	fd = open(path,O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return 1;
+	r = read(fd,buf,len -1);
+	close(fd);
+	if(r <= 0)
+		return 1;
+	buf[r] = '\0';
+	return 0;
+}
+
+/* default huge page size, from /proc/meminfo */
+static size_t huge_pagesize(void)
+{
+	char buf[4096],*s;
+	if(read_file("/proc/meminfo",buf,sizeof(buf)))
+		return 0;
+	s = strstr(buf,"Hugepagesize:");
+	if(s == NULL)
+		return 0;
+	return strtoul(s + strlen("Hugepagesize:"),NULL,10) << 10;
+}
+
+/* color function: the one of the module if it is loaded. Otherwise
+ * pfn modulo the number of colors, from the environment or computed
+ * like the ccontrol utility does from the last level cache.
+ */
+static int huge_colorfn(ioctl_colorfn *f, size_t pgsize)
+{
+	char path[80],buf[80],*env;
+	size_t size = 0;
+	unsigned long assoc;
+	int i;
+	if(access(MODULE_CONTROL_DEVICE,F_OK) == 0)
+		return ccontrol_color_function(f);
+	f->func = IOCTL_COLOR_MOD;
+	f->nbmasks = 0;
+	f->colors = 0;
+	env = getenv(CCONTROL_ENV_COLORS);
+	if(env != NULL)
+	{
+		f->colors = strtoul(env,NULL,0);
+		return 0;
+	}
+	for(i = HUGE_MAXINDEX -1; i >= 0; i--)
+	{
+		snprintf(path,80,HUGE_SYSCACHE "%d/size",i);
+		if(read_file(path,buf,80) == 0)
+			break;
+	}
+	if(i < 0 || ccontrol_str2size(&size,buf))
+		return 1;
+	snprintf(path,80,HUGE_SYSCACHE "%d/ways_of_associativity",i);
+	if(read_file(path,buf,80))
+		return 1;
+	assoc = strtoul(buf,NULL,10);
+	if(assoc == 0)
+		return 1;
+	f->colors = size/(assoc*pgsize);
+	return 0;
+}
+
+/* color of a page frame, like the module computes it */
+static unsigned int huge_pfn2color(ioctl_colorfn *f, unsigned long pfn)
+{
+	unsigned int i,c = 0;
+	unsigned long m;
+	if(f->func == IOCTL_COLOR_MOD)
+		return pfn % f->colors;
+	if(f->func == IOCTL_COLOR_BITS)
+	{
+		/* selected bits, packed together */
+		for(i = 0, m = f->masks[0]; m != 0; i++, m &= m -1)
+			if(pfn & m & -m)
+				c |= 1U << i;
+		return c;
+	}
+	for(i = 0; i < f->nbmasks; i++)
+		c |= (__builtin_popcountl(pfn & f->masks[i]) & 1) << i;
+	return c;
+}
+
+/* the color only depends on the place of a page in its huge page */
+static int huge_aligned(ioctl_colorfn *f, size_t perhuge)
+{
+	unsigned int i;
+	if(f->func == IOCTL_COLOR_MOD)
+		return perhuge % f->colors == 0;
+	/* huge pages are a power of two of pages */
+	for(i = 0; i < f->nbmasks; i++)
+		if(f->masks[i] & ~(perhuge -1))
+			return 0;
+	return 1;
+}
+
+/* color of each small page of the zone */
+static int huge_pagecolors(struct ccontrol_zone *z, size_t pgsize, size_t hsize,
+		ioctl_colorfn *f)
+{
+	int fd;
+	size_t i,perhuge = hsize / pgsize;
+	uint64_t e;
+	unsigned long pfn = 0;
+	/* huge pages are aligned on their size */
+	if(huge_aligned(f,perhuge))
+	{
+		for(i = 0; i < z->nbpages; i++)
+			z->colors[i] = huge_pfn2color(f,i % perhuge);
+		return 0;
+	}
+	fd = open("/proc/self/pagemap",O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+	{
+		perror("hugetlb zone pagemap open:");
+		return 1;
+	}
+	for(i = 0; i < z->nbpages; i++)
+	{
+		if(i % perhuge == 0)
+		{
+			if(pread(fd,&e,sizeof(e),((size_t)z->p/pgsize + i)*sizeof(e)) != sizeof(e))
+			{
+				perror("hugetlb zone pagemap read:");
+				close(fd);
+				return 1;
+			}
+			pfn = e & ((1ULL << 55) -1);
+			if(pfn == 0)
+			{
+				fprintf(stderr,"ccontrol: physical addresses unavailable, the color function must only use the pages of a huge page\n");
+				close(fd);
+				return 1;
+			}
+		}
+		z->colors[i] = huge_pfn2color(f,pfn + i % perhuge);
+	}
+	close(fd);
+	return 0;
+}
+
+/* longest run of pages of our colors, in bytes */
+static size_t huge_maxrun(struct ccontrol_zone *z, size_t pgsize, color_set *c)
+{
+	size_t i,run = 0,max = 0;
+	for(i = 0; i < z->nbpages; i++)
+	{
+		run = COLOR_ISSET(z->colors[i],c) ? run + 1 : 0;
+		if(run > max)
+			max = run;
+	}
+	return max * pgsize;
+}
+
+/* an allocation failed: warn once if it could not fit between holes */
+static void huge_toobig(struct ccontrol_zone *z, size_t size)
+{
+	static int warned = 0;
+	if(z->maxrun == 0 || size + ALLOCATOR_OVERHEAD <= z->maxrun)
+		return;
+	if(__atomic_exchange_n(&warned,1,__ATOMIC_RELAXED))
+		return;
+	fprintf(stderr,"ccontrol: allocation of %zu bytes bigger than the %zu bytes between holes of a hugetlb zone, use a contiguous color set\n",
+			size,z->maxrun);
+}
+
+struct huge_ok_arg {
+	unsigned int *colors;
+	color_set *c;
+};
+
+static int huge_ok(void *arg, size_t pg)
+{
+	struct huge_ok_arg *a = (struct huge_ok_arg *)arg;
+	return COLOR_ISSET(a->colors[pg],a->c);
+}
+
+static int zone_create_huge(struct ccontrol_zone *z, color_set *c, size_t size,
+		int flags)
+{
+	size_t i,pgsize,hsize,mapsize,nbset = 0;
+	unsigned int colors;
+	ioctl_colorfn fn;
+	struct huge_ok_arg arg;
+	if(flags & (CCONTROL_ZONE_GROW | CCONTROL_ZONE_ARENA))
+	{
+		fprintf(stderr,"ccontrol: hugetlb zones cannot grow or be arenas\n");
+		return 1;
+	}
+	pgsize = sysconf(_SC_PAGESIZE);
+	hsize = huge_pagesize();
+	if(huge_colorfn(&fn,pgsize))
+		fn.colors = 0;
+	colors = fn.colors;
+	if(hsize == 0 || colors == 0 || colors > COLOR_SETSIZE)
+	{
+		fprintf(stderr,"ccontrol: cannot find the huge page size or the number of colors\n");
+		return 1;
+	}
+	for(i = 0; i < colors; i++)
+		if(COLOR_ISSET(i,c))
+			nbset++;
+	if(nbset == 0)
+	{
+		fprintf(stderr,"ccontrol: empty color set\n");
+		return 1;
+	}
+	/* enough huge pages to get size bytes of our colors */
+	mapsize = (size + pgsize -1) / pgsize * colors / nbset * pgsize;
+	mapsize = (mapsize + 2*hsize -1) & ~(hsize -1);
+	z->p = mmap(NULL,mapsize,PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,-1,0);
+	if(z->p == MAP_FAILED)
+	{
+		perror("hugetlb zone mmap:");
+		z->p = NULL;
+		return 1;
+	}
+	zone_setup(z,-1,mapsize,mapsize,flags);
+	z->nbpages = mapsize / pgsize;
+	z->colors = mmap(NULL,z->nbpages*sizeof(unsigned int),PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+	if(z->colors == MAP_FAILED)
+	{
+		perror("zone colors mmap:");
+		z->colors = NULL;
+		goto unmap;
+	}
+	if(huge_pagecolors(z,pgsize,hsize,&fn))
+		goto unmap;
+	if(nbset < colors)
+		z->maxrun = huge_maxrun(z,pgsize,c);
+	arg.colors = z->colors;
+	arg.c = c;
+	if(fl_init_pages(z->p,mapsize,pgsize,huge_ok,&arg))
+	{
+		fprintf(stderr,"ccontrol: pages too small for the allocator\n");
+		goto unmap;
+	}
+	return 0;
+unmap:
+	if(z->colors != NULL)
+		munmap(z->colors,z->nbpages*sizeof(unsigned int));
+	z->colors = NULL;
+	munmap(z->p,mapsize);
+	z->p = NULL;
+	return 1;
+}
+
+/* zone flags the module takes care of */
+static int zone_devflags(int flags)
+{
+	return (flags & CCONTROL_ZONE_POPULATE) ? IOCTL_FLAG_POPULATE : 0;
+}
+
+int ccontrol_create_zone_flags(struct ccontrol_zone *z, color_set *c, size_t size,
+		int flags)
+{
+	return ccontrol_create_zone_node(z,c,size,flags,CCONTROL_NODE_ANY);
+}
+
+int ccontrol_create_zone_node(struct ccontrol_zone *z, color_set *c, size_t size,
+		int flags, int node)
+{
+	int fd_cc,err;
+	ioctl_args io_args;
+	if(z == NULL || c == NULL)
+		return 1;
+	if((flags & CCONTROL_ZONE_GROW) && (flags & CCONTROL_ZONE_ARENA))
+	{
+		fprintf(stderr,"ccontrol: arena zones cannot grow\n");
+		return 1;
+	}
+	if(zone_hugetlb(flags))
+		return zone_create_huge(z,c,size,flags);
+	fd_cc = control_get();
+	if(fd_cc == -1)
+		return 1;
+	/* tell him to create a new zone, without a device */
+	io_args.size = size;
+	io_args.flags = zone_devflags(flags);
+	io_args.node = node;
+	io_args.c = *c;
+	err = ioctl(fd_cc,IOCTL_NEW_FD,&io_args);
+	if(err == -1)
+	{
+		perror("module control device ioctl:");
+		return 1;
+	}
+	err = zone_map(z,io_args.fd,size,flags);
+	if(err)
+		close(io_args.fd);
+	return err;
+}
+
+int ccontrol_create_zones(struct ccontrol_zone **z, color_set *c, size_t *size,
+		int flags, unsigned int n)
+{
+	int fd_cc,err;
+	unsigned int i;
+	ioctl_args io_args[IOCTL_MAX_BATCH];
+	ioctl_batch batch;
+	if(z == NULL || c == NULL || size == NULL || n == 0 || n > IOCTL_MAX_BATCH)
+		return 1;
+	if((flags & CCONTROL_ZONE_GROW) && (flags & CCONTROL_ZONE_ARENA))
+	{
+		fprintf(stderr,"ccontrol: arena zones cannot grow\n");
+		return 1;
+	}
+	/* without the module, there is nothing to batch */
+	if(zone_hugetlb(flags))
+	{
+		for(i = 0; i < n; i++)
+			if(z[i] == NULL || zone_create_huge(z[i],&c[i],size[i],flags))
+				break;
+		if(i == n)
+			return 0;
+		while(i > 0)
+			ccontrol_destroy_zone(z[--i]);
+		return 1;
+	}
+	for(i = 0; i < n; i++)
+	{
+		if(z[i] == NULL)
+			return 1;
+		io_args[i].size = size[i];
+		io_args[i].flags = zone_devflags(flags);
+		io_args[i].node = CCONTROL_NODE_ANY;
+		io_args[i].c = c[i];
+	}
+	fd_cc = control_get();
+	if(fd_cc == -1)
+		return 1;
+	/* a single ioctl creates all the devices */
+	batch.count = n;
+	batch.args = io_args;
+	err = ioctl(fd_cc,IOCTL_NEW_BATCH,&batch);
 	if(err == -1)
+	{
+		perror("module control device ioctl:");
+		return 1;
+	}
+	for(i = 0; i < n; i++)
+		if(zone_attach(z[i],&io_args[i],size[i],flags))
+			goto undo;
+	return 0;
+
+undo:
+	while(i > 0)
+	{
+		i--;
+		zone_detach(z[i],&io_args[i]);
+	}
+	ioctl(fd_cc,IOCTL_FREE_BATCH,&batch);
+	return 1;
+}
+
+/* this function destroys a zone and its associated device. */
+int ccontrol_destroy_zone(struct ccontrol_zone *z)
+{
+	int fd_cc,err = 0;
+	ioctl_args io_args;
+	if(z == NULL)
+		return 1;
+	err = zone_detach(z,&io_args);
+	if(z->dev == 0)
+		return err;
+	fd_cc = control_get();
+	if(fd_cc == -1)
+		return 1;
+	/* now destroy the device */
+	if(ioctl(fd_cc,IOCTL_FREE,&io_args) == -1)
 	{
 		perror("module control device ioctl:");
 		err = 1;
 	}
-	close(fd_cc);
 	return err;
 }
 
+int ccontrol_destroy_zones(struct ccontrol_zone **z, unsigned int n)
+{
+	int fd_cc,err = 0;
+	unsigned int i,nbdev = 0;
+	ioctl_args io_args[IOCTL_MAX_BATCH];
+	ioctl_batch batch;
+	if(z == NULL || n == 0 || n > IOCTL_MAX_BATCH)
+		return 1;
+	for(i = 0; i < n; i++)
+		if(z[i] == NULL)
+			return 1;
+	/* only zones with a device need the module */
+	for(i = 0; i < n; i++)
+		if(z[i]->dev == 0)
+			err |= zone_detach(z[i],&io_args[nbdev]);
+		else
+			err |= zone_detach(z[i],&io_args[nbdev++]);
+	if(nbdev == 0)
+		return err;
+	fd_cc = control_get();
+	if(fd_cc == -1)
+		return 1;
+	batch.count = nbdev;
+	batch.args = io_args;
+	if(ioctl(fd_cc,IOCTL_FREE_BATCH,&batch) == -1)
+	{
+		perror("module control device ioctl:");
+		err = 1;
+	}
+	return err;
+}
+
+int ccontrol_zone_fault_around(struct ccontrol_zone *z, unsigned int pages)
+{
+	if(z == NULL || z->p == NULL || z->fd == -1)
+		return 1;
+	if(ioctl(z->fd,IOCTL_FAULT_AROUND,(unsigned long)pages) == -1)
+	{
+		perror("module color device ioctl:");
+		return 1;
+	}
+	return 0;
+}
+
+int ccontrol_zone_contains(struct ccontrol_zone *z, void *ptr)
+{
+	if(z == NULL || z->p == NULL)
+		return 0;
+	return (char *)ptr >= (char *)z->p && (char *)ptr < (char *)z->p + z->size;
+}
+
+/* growable zones:
+ * when the freelist is full, we ask the module for more pages and map
+ * them right after the zone, in the address space reserved at creation.
+ * The zone grows by at least its initial size.
+ * Called with the zone lock held, returns 0 if the zone grew enough
+ * for a block of size bytes aligned on align.
+ */
+static int zone_grow(struct ccontrol_zone *z, size_t align, size_t size)
+{
+	ioctl_args io_args;
+	size_t need,grow,pgsize;
+	void *p;
+	if(!(z->flags & CCONTROL_ZONE_GROW))
+		return 1;
+	need = fl_adjustsize(size);
+	if(need == 0 || need > SIZE_MAX/2 - align - 2*FL_MINSIZE)
+		return 1;
+	need += align + 2*FL_MINSIZE;
+	grow = need > z->chunk ? need : z->chunk;
+	pgsize = sysconf(_SC_PAGESIZE);
+	grow = (grow + pgsize -1) & ~(pgsize -1);
+	if(grow > z->reserved - z->size)
+		return 1;
+	io_args.size = grow;
+	if(ioctl(z->fd,IOCTL_GROW,&io_args) == -1)
+	{
+		perror("module color device ioctl:");
+		return 1;
+	}
+	p = mmap((char *)z->p + z->size,grow,PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED,z->fd,z->size);
+	if(p == MAP_FAILED)
+	{
+		perror("module color device mmap:");
+		return 1;
+	}
+	if(fl_extend(z->p,z->size,z->size + grow))
+		return 1;
+	z->size += grow;
+	/* colors are asked again when needed */
+	if(z->colors != NULL)
+		munmap(z->colors,z->nbpages*sizeof(unsigned int));
+	z->colors = NULL;
+	z->nbpages = 0;
+	return 0;
+}
+
+/* thread caches management */
+
+/* give all the cached blocks back to their zone.
+ * Called with the zone and cache locks held. */
+static void cache_drain(struct ccontrol_cache *c)
+{
+	unsigned int i;
+	void *p;
+	for(i = 0; i < FL_SMALLBINS; i++)
+	{
+		while(c->blocks[i] != NULL)
+		{
+			p = c->blocks[i];
+			c->blocks[i] = *(void **)p;
+			fl_free(c->z->p,p);
+		}
+		c->count[i] = 0;
+	}
+}
+
+/* empty the cache and detach it from its zone.
+ * caches_lock keeps the zone alive: destroying it needs that lock to
+ * detach its caches. */
+static void cache_exit(void *arg)
+{
+	struct ccontrol_cache *c = arg;
+	struct ccontrol_cache **it;
+	struct ccontrol_zone *z;
+	pthread_mutex_lock(&caches_lock);
+	z = c->z;
+	if(z != NULL)
+	{
+		pthread_mutex_lock(&z->lock);
+		pthread_mutex_lock(&c->lock);
+		cache_drain(c);
+		for(it = &z->caches; *it != NULL; it = &(*it)->next)
+			if(*it == c)
+			{
+				*it = c->next;
+				break;
+			}
+		c->z = NULL;
+		pthread_mutex_unlock(&c->lock);
+		pthread_mutex_unlock(&z->lock);
+	}
+	pthread_mutex_unlock(&caches_lock);
+}
+
+static void cache_key_create(void)
+{
+	pthread_key_create(&cache_key,cache_exit);
+}
+
+/* returns the calling thread cache, attached to z and locked */
+static struct ccontrol_cache *cache_get(struct ccontrol_zone *z)
+{
+	struct ccontrol_cache *c = &thread_cache;
+	pthread_mutex_lock(&c->lock);
+	if(c->z == z)
+		return c;
+	pthread_mutex_unlock(&c->lock);
+	if(!c->registered)
+	{
+		pthread_once(&cache_key_once,cache_key_create);
+		pthread_setspecific(cache_key,c);
+		c->registered = 1;
+	}
+	cache_exit(c);
+	pthread_mutex_lock(&caches_lock);
+	pthread_mutex_lock(&c->lock);
+	c->z = z;
+	c->next = z->caches;
+	z->caches = c;
+	pthread_mutex_unlock(&caches_lock);
+	return c;
+}
+
+static void *threadsafe_malloc(struct ccontrol_zone *z, size_t size)
+{
+	struct ccontrol_cache *c;
+	size_t bsize = fl_adjustsize(size);
+	unsigned int i = bsize / FL_ALIGN;
+	void *p;
+	if(size != 0 && bsize != 0 && bsize < FL_SMALLLIMIT)
+	{
+		c = cache_get(z);
+		p = c->blocks[i];
+		if(p != NULL)
+		{
+			c->blocks[i] = *(void **)p;
+			c->count[i]--;
+		}
+		pthread_mutex_unlock(&c->lock);
+		if(p != NULL)
+			return p;
+	}
+	pthread_mutex_lock(&z->lock);
+	p = fl_allocate(z->p,size);
+	/* our own cache might be holding the memory we need */
+	if(p == NULL)
+	{
+		c = &thread_cache;
+		pthread_mutex_lock(&c->lock);
+		if(c->z == z)
+			cache_drain(c);
+		pthread_mutex_unlock(&c->lock);
+		p = fl_allocate(z->p,size);
+	}
+	if(p == NULL && !zone_grow(z,FL_ALIGN,size))
+		p = fl_allocate(z->p,size);
+	pthread_mutex_unlock(&z->lock);
+	return p;
+}
+
+static void threadsafe_free(struct ccontrol_zone *z, void *ptr)
+{
+	struct ccontrol_cache *c;
+	fl *f;
+	size_t bsize;
+	unsigned int i;
+	if(ptr == NULL)
+		return;
+	/* the lock holder might be updating the flags of this header, but
+	 * never its size */
+	f = VOID_TO_FL(ptr);
+	bsize = __atomic_load_n(&f->size,__ATOMIC_RELAXED) & ~FL_FLAGS;
+	i = bsize / FL_ALIGN;
+	/* blocks from another zone than the one we allocate from
+	 * go back directly */
+	c = &thread_cache;
+	if(bsize < FL_SMALLLIMIT)
+	{
+		pthread_mutex_lock(&c->lock);
+		if(c->z == z && c->count[i] < CACHE_DEPTH)
+		{
+			*(void **)ptr = c->blocks[i];
+			c->blocks[i] = ptr;
+			c->count[i]++;
+			pthread_mutex_unlock(&c->lock);
+			return;
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+	pthread_mutex_lock(&z->lock);
+	fl_free(z->p,ptr);
+	pthread_mutex_unlock(&z->lock);
+}
+
+/* arena zones:
+ * memory is given in order, by moving the top of the zone. There is no
+ * header: the only allocation we know the start of is the last one, it
+ * is the only one free and realloc can do something about.
+ */
+static inline void zone_lock(struct ccontrol_zone *z)
+{
+	if(z->flags & CCONTROL_ZONE_THREADSAFE)
+		pthread_mutex_lock(&z->lock);
+}
+
+static inline void zone_unlock(struct ccontrol_zone *z)
+{
+	if(z->flags & CCONTROL_ZONE_THREADSAFE)
+		pthread_mutex_unlock(&z->lock);
+}
+
+static void *arena_malloc(struct ccontrol_zone *z, size_t align, size_t size)
+{
+	size_t start;
+	void *ret = NULL;
+	if(size == 0)
+		return NULL;
+	zone_lock(z);
+	start = (z->top + align -1) & ~(align -1);
+	if(start >= z->top && start <= z->size && size <= z->size - start)
+	{
+		z->last = start;
+		z->top = start + size;
+		ret = (char *)z->p + start;
+	}
+	zone_unlock(z);
+	return ret;
+}
+
+static void arena_free(struct ccontrol_zone *z, void *ptr)
+{
+	zone_lock(z);
+	if((char *)ptr == (char *)z->p + z->last)
+	{
+		z->top = z->last;
+		z->last = z->size;
+	}
+	zone_unlock(z);
+}
+
+static void *arena_realloc(struct ccontrol_zone *z, void *ptr, size_t size)
+{
+	size_t off,top;
+	void *ret;
+	if(ptr == NULL)
+		return arena_malloc(z,FL_ALIGN,size);
+	if(size == 0)
+	{
+		arena_free(z,ptr);
+		return NULL;
+	}
+	off = (char *)ptr - (char *)z->p;
+	zone_lock(z);
+	if(off == z->last && size <= z->size - off)
+	{
+		z->top = off + size;
+		zone_unlock(z);
+		return ptr;
+	}
+	top = z->top;
+	zone_unlock(z);
+	/* we do not know the old size: copy what can be there, the new
+	 * block starts after the current top so they cannot overlap */
+	ret = arena_malloc(z,FL_ALIGN,size);
+	if(ret != NULL)
+		memcpy(ret,ptr,size < top - off ? size : top - off);
+	return ret;
+}
+
+size_t ccontrol_arena_mark(struct ccontrol_zone *z)
+{
+	size_t ret;
+	if(z == NULL || !(z->flags & CCONTROL_ZONE_ARENA))
+		return 0;
+	zone_lock(z);
+	ret = z->top;
+	zone_unlock(z);
+	return ret;
+}
+
+void ccontrol_arena_rewind(struct ccontrol_zone *z, size_t mark)
+{
+	if(z == NULL || !(z->flags & CCONTROL_ZONE_ARENA))
+		return;
+	zone_lock(z);
+	if(mark < z->top)
+	{
+		z->top = mark;
+		z->last = z->size;
+	}
+	zone_unlock(z);
+}
+
 /* allocates memory inside the zone, use the freelist backend */
 void *ccontrol_malloc(struct ccontrol_zone *z, size_t size)
 {
+	void *ret;
 	if(z == NULL || z->p == NULL)
 		return NULL;
-	return fl_allocate(z->p,size);
+	if(z->flags & CCONTROL_ZONE_ARENA)
+		return arena_malloc(z,FL_ALIGN,size);
+	if(z->flags & CCONTROL_ZONE_THREADSAFE)
+		ret = threadsafe_malloc(z,size);
+	else
+	{
+		ret = fl_allocate(z->p,size);
+		if(ret == NULL && size != 0 && !zone_grow(z,FL_ALIGN,size))
+			ret = fl_allocate(z->p,size);
+	}
+	if(ret == NULL)
+		huge_toobig(z,size);
+	return ret;
 }
 
 void ccontrol_free(struct ccontrol_zone *z, void *ptr)
 {
-	if(z == NULL || z->p == NULL)
+	if(z == NULL || z->p == NULL || ptr == NULL)
 		return;
-	fl_free(z->p,ptr);
+	if(z->flags & CCONTROL_ZONE_ARENA)
+		arena_free(z,ptr);
+	else if(z->flags & CCONTROL_ZONE_THREADSAFE)
+		threadsafe_free(z,ptr);
+	else
+		fl_free(z->p,ptr);
 }
 
 void *ccontrol_realloc(struct ccontrol_zone *z, void *ptr, size_t size)
 {
+	void *ret;
+	if(z == NULL || z->p == NULL)
+		return NULL;
+	if(z->flags & CCONTROL_ZONE_ARENA)
+		return arena_realloc(z,ptr,size);
+	if(ptr == NULL)
+		return ccontrol_malloc(z,size);
+	zone_lock(z);
+	ret = fl_realloc(z->p,ptr,size);
+	if(ret == NULL && size != 0 && !zone_grow(z,FL_ALIGN,size))
+		ret = fl_realloc(z->p,ptr,size);
+	zone_unlock(z);
+	if(ret == NULL)
+		huge_toobig(z,size);
+	return ret;
+}
+
+void *ccontrol_memalign(struct ccontrol_zone *z, size_t align, size_t size)
+{
+	void *ret;
 	if(z == NULL || z->p == NULL)
 		return NULL;
-	return fl_realloc(z->p,ptr,size);
+	if(z->flags & CCONTROL_ZONE_ARENA)
+	{
+		if((align & (align -1)) != 0)
+			return NULL;
+		return arena_malloc(z,align < FL_ALIGN ? FL_ALIGN : align,size);
+	}
+	if(align <= FL_ALIGN)
+		return ccontrol_malloc(z,size);
+	zone_lock(z);
+	ret = fl_memalign(z->p,align,size);
+	if(ret == NULL && size != 0 && !zone_grow(z,align,size))
+		ret = fl_memalign(z->p,align,size);
+	zone_unlock(z);
+	if(ret == NULL)
+		huge_toobig(z,size + align);
+	return ret;
+}
+
+size_t ccontrol_usable_size(struct ccontrol_zone *z, void *ptr)
+{
+	size_t ret = 0;
+	if(z == NULL || z->p == NULL)
+		return 0;
+	if(!(z->flags & CCONTROL_ZONE_ARENA))
+		return fl_usable_size(ptr);
+	/* only the last allocation has a known size */
+	zone_lock(z);
+	if((char *)ptr == (char *)z->p + z->last)
+		ret = z->top - z->last;
+	zone_unlock(z);
+	return ret;
+}
+
+/* page colors:
+ * the module knows the color of each page of the device, we ask for
+ * them once and keep them with the zone. The array is mapped
+ * directly, malloc might be our own.
+ * Growing the zone replaces the array: callers hold the zone lock as
+ * long as they use it.
+ */
+static int zone_colors(struct ccontrol_zone *z)
+{
+	ioctl_colors io_colors;
+	size_t pgsize = sysconf(_SC_PAGESIZE);
+	size_t nb = (z->size + pgsize -1) / pgsize;
+	unsigned int *colors;
+	if(z->colors != NULL)
+		return 0;
+	colors = mmap(NULL,nb*sizeof(unsigned int),PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+	if(colors == MAP_FAILED)
+	{
+		perror("zone colors mmap:");
+		return 1;
+	}
+	io_colors.nbpages = nb;
+	io_colors.colors = colors;
+	if(ioctl(z->fd,IOCTL_COLORS,&io_colors) == -1)
+	{
+		perror("module color device ioctl:");
+		munmap(colors,nb*sizeof(unsigned int));
+		return 1;
+	}
+	/* the device has at least as many pages as the mapping */
+	z->nbpages = nb;
+	z->colors = colors;
+	return 0;
+}
+
+int ccontrol_color_function(ioctl_colorfn *f)
+{
+	int fd_cc;
+	if(f == NULL)
+		return 1;
+	fd_cc = control_get();
+	if(fd_cc == -1)
+		return 1;
+	if(ioctl(fd_cc,IOCTL_COLOR_FUNC,f) == -1)
+	{
+		perror("module control device ioctl:");
+		return 1;
+	}
+	return 0;
+}
+
+static int control_resize(unsigned long code, size_t *size, int node)
+{
+	int fd_cc,err;
+	ioctl_resize io_resize;
+	if(size == NULL)
+		return 1;
+	fd_cc = control_get();
+	if(fd_cc == -1)
+		return 1;
+	io_resize.node = node;
+	io_resize.size = *size;
+	err = ioctl(fd_cc,code,&io_resize);
+	*size = io_resize.size;
+	if(err == -1)
+	{
+		perror("module control device ioctl:");
+		return 1;
+	}
+	return 0;
+}
+
+int ccontrol_reserve_memory(size_t *size, int node)
+{
+	return control_resize(IOCTL_RESERVE,size,node);
+}
+
+int ccontrol_release_memory(size_t *size, int node)
+{
+	return control_resize(IOCTL_RELEASE,size,node);
+}
+
+const unsigned int *ccontrol_zone_colors(struct ccontrol_zone *z, size_t *nbpages)
+{
+	const unsigned int *ret = NULL;
+	if(z == NULL || z->p == NULL || nbpages == NULL)
+		return NULL;
+	zone_lock(z);
+	if(!zone_colors(z))
+	{
+		*nbpages = z->nbpages;
+		ret = z->colors;
+	}
+	zone_unlock(z);
+	return ret;
 }
 
+int ccontrol_page_color(struct ccontrol_zone *z, void *ptr)
+{
+	int ret = -1;
+	if(!ccontrol_zone_contains(z,ptr))
+		return -1;
+	zone_lock(z);
+	if(!zone_colors(z))
+		ret = z->colors[((char *)ptr - (char *)z->p) / sysconf(_SC_PAGESIZE)];
+	zone_unlock(z);
+	return ret;
+}
+
+struct colors_filter {
+	struct ccontrol_zone *z;
+	color_set *c;
+};
+
+static int page_allowed(void *arg, size_t pg)
+{
+	struct colors_filter *f = arg;
+	return pg < f->z->nbpages && COLOR_ISSET(f->z->colors[pg],f->c);
+}
+
+void *ccontrol_malloc_colors(struct ccontrol_zone *z, color_set *c, size_t size)
+{
+	void *ret;
+	struct colors_filter filter;
+	if(z == NULL || z->p == NULL || c == NULL)
+		return NULL;
+	if(z->flags & CCONTROL_ZONE_ARENA)
+		return NULL;
+	filter.z = z;
+	filter.c = c;
+	/* the colors array must not change while we look at it */
+	zone_lock(z);
+	ret = NULL;
+	if(!zone_colors(z))
+		ret = fl_allocate_pages(z->p,size,sysconf(_SC_PAGESIZE),page_allowed,&filter);
+	zone_unlock(z);
+	return ret;
+}
 
 int ccontrol_str2cset(color_set *c, char *str)
 {
@@ -17,7 +17,8 @@
 /* CControl library: provides colored memory allocations.
  * Tighly coupled with its Linux kernel module (in case of errors,
  * check that the library and module are in sync).
- * Warning: this library is NOT thread-safe.
+ * Warning: zones are NOT thread-safe, unless created with
+ * CCONTROL_ZONE_THREADSAFE.
  */
 #ifndef MODULE_CONTROL_DEVICE
 #define MODULE_CONTROL_DEVICE "/dev/ccontrol"
@@ -29,6 +30,70 @@ struct ccontrol_zone;
 /* environment variables names */
 #define CCONTROL_ENV_PARTITION_COLORSET "CCONTROL_PSET"
 #define CCONTROL_ENV_SIZE "CCONTROL_SIZE"
+#define CCONTROL_ENV_THREADSAFE "CCONTROL_THREADSAFE"
+#define CCONTROL_ENV_ARENA "CCONTROL_ARENA"
+#define CCONTROL_ENV_GROW "CCONTROL_GROW"
+#define CCONTROL_ENV_POPULATE "CCONTROL_POPULATE"
+#define CCONTROL_ENV_NODE "CCONTROL_NODE"
+#define CCONTROL_ENV_BACKEND "CCONTROL_BACKEND"
+#define CCONTROL_ENV_COLORS "CCONTROL_COLORS"
+
+/* the LD_PRELOAD library can give each thread its own zone, when
+ * CCONTROL_PSET contains several color sets separated by ':'.
+ * Threads after this limit share the existing zones.
+ */
+#define CCONTROL_PSET_SEPARATOR ':'
+#define CCONTROL_MAX_THREAD_ZONES 256
+
+/* zone flags:
+ * THREADSAFE: the zone can be used by several threads at the same
+ * time. Each thread caches the small blocks it frees, a thread
+ * only takes the zone lock when its cache cannot help.
+ */
+#define CCONTROL_ZONE_THREADSAFE 1
+/* ARENA: the zone only moves a pointer forward on allocation, no
+ * memory is used for allocator metadata. Free only reclaims the
+ * last allocation, use ccontrol_arena_rewind to free everything
+ * allocated since a mark.
+ * ccontrol_memsize2zonesize is not needed for such zones.
+ */
+#define CCONTROL_ZONE_ARENA 2
+/* GROW: the zone size is only its initial size. When the zone is
+ * full, the module gives it more pages of the same colors, at least
+ * as many as the initial size. Cannot be used with ARENA.
+ */
+#define CCONTROL_ZONE_GROW 4
+/* POPULATE: all the zone pages are mapped when it is created (and
+ * when it grows), the zone never page faults.
+ */
+#define CCONTROL_ZONE_POPULATE 8
+/* HUGETLB: the zone is made of huge pages instead of module pages,
+ * the module is not needed. Pages of other colors are kept as unused
+ * holes inside the zone: an allocation bigger than the longest run of
+ * pages of the zone colors fails, even if the zone has enough free
+ * memory (a warning is printed the first time). With colors 0-31 of
+ * 64 and 4K pages, runs are 128K long. Cannot be used with ARENA or
+ * GROW.
+ * Setting CCONTROL_BACKEND=hugetlb in the environment does the same
+ * for all zones. If the module is loaded, its color function is used.
+ * Otherwise the color of a page is its pfn modulo the number of
+ * colors, CCONTROL_COLORS or computed from the last level cache.
+ */
+#define CCONTROL_ZONE_HUGETLB 16
+
+/* NUMA nodes a zone takes its pages from:
+ * ANY: the node of the calling thread if it has some, any other one
+ * otherwise.
+ * LOCAL: only the node of the calling thread.
+ * A node number only uses pages of that node.
+ * Nodes are the finest placement zones get: the module keeps a single
+ * pool of each color per node. When a node has several last level
+ * caches, there is no zone bound to one of them: run the threads using
+ * the zone on the cpus of that cache (see ccontrol info and
+ * ccontrol exec --domain), its colors are then the ones of that cache.
+ */
+#define CCONTROL_NODE_ANY -1
+#define CCONTROL_NODE_LOCAL -2
 
 /* allocates a zone */
 struct ccontrol_zone * ccontrol_new(void);
@@ -49,11 +114,38 @@ size_t ccontrol_memsize2zonesize(unsigned int nballoc, size_t memsize);
  * Return 0 on success. */
 int ccontrol_create_zone(struct ccontrol_zone *, color_set *, size_t);
 
+/* Same as ccontrol_create_zone, with flags (see above) */
+int ccontrol_create_zone_flags(struct ccontrol_zone *, color_set *, size_t, int);
+
+/* Same as ccontrol_create_zone_flags, with pages of a NUMA node (see above) */
+int ccontrol_create_zone_node(struct ccontrol_zone *, color_set *, size_t, int, int);
+
 /* Destroys a zone.
  * Any allocation done inside it will no longer work.
  */
 int ccontrol_destroy_zone(struct ccontrol_zone *);
 
+/* Creates n zones (at most IOCTL_MAX_BATCH) with the same flags,
+ * the i-th one with the i-th color set and size, asking the module
+ * for all of them at once. Either all zones are created or none.
+ * Return 0 on success. */
+int ccontrol_create_zones(struct ccontrol_zone **, color_set *, size_t *, int, unsigned int);
+
+/* Destroys n zones at once */
+int ccontrol_destroy_zones(struct ccontrol_zone **, unsigned int);
+
+/* The library keeps the module control device open once it has
+ * used it. This closes it, it will be opened again if needed. */
+void ccontrol_release(void);
+
+/* Sets how many pages are mapped each time the zone page faults,
+ * 0 or 1 to map one page at a time. The default is a parameter of
+ * the module. Return 0 on success. */
+int ccontrol_zone_fault_around(struct ccontrol_zone *, unsigned int);
+
+/* Tells if a pointer is inside a zone */
+int ccontrol_zone_contains(struct ccontrol_zone *, void *);
+
 /* Allocates memory inside the zone. Similar to POSIX malloc
  */
 void *ccontrol_malloc(struct ccontrol_zone *, size_t);
@@ -64,6 +156,68 @@ void ccontrol_free(struct ccontrol_zone *, void *);
 /* realloc memory */
 void *ccontrol_realloc(struct ccontrol_zone *, void *, size_t);
 
+/* Allocates memory aligned on a power of two, similar to memalign.
+ * Free it with ccontrol_free. */
+void *ccontrol_memalign(struct ccontrol_zone *, size_t, size_t);
+
+/* How many bytes an allocation can really hold,
+ * similar to malloc_usable_size */
+size_t ccontrol_usable_size(struct ccontrol_zone *, void *);
+
+/* Gives the color of each page of the zone, in address order.
+ * The array belongs to the zone, nbpages is set to its size. It is
+ * only valid until the zone grows.
+ * Returns NULL on error. */
+const unsigned int *ccontrol_zone_colors(struct ccontrol_zone *, size_t *nbpages);
+
+/* Color of the page containing a pointer of the zone, -1 on error */
+int ccontrol_page_color(struct ccontrol_zone *, void *);
+
+/* Gives the function the module uses to compute the color of a page
+ * (see ioctls.h). Returns 0 on success. */
+int ccontrol_color_function(ioctl_colorfn *);
+
+/* Changes the amount of memory reserved by the module, on a node or
+ * split between all of them (CCONTROL_NODE_ANY). Release only gives
+ * back memory no zone uses. size is set to what was really done.
+ * Returns 0 on success. */
+int ccontrol_reserve_memory(size_t *size, int node);
+int ccontrol_release_memory(size_t *size, int node);
+
+/* Allocates memory only backed by pages of the given colors, which
+ * should be a subset of the zone colors. Free it with ccontrol_free.
+ * Slower than ccontrol_malloc, not available for arena zones.
+ */
+void *ccontrol_malloc_colors(struct ccontrol_zone *, color_set *, size_t);
+
+/* Arena zones: get the current position in the zone */
+size_t ccontrol_arena_mark(struct ccontrol_zone *);
+
+/* Arena zones: free all allocations done after the mark,
+ * a mark of 0 empties the zone. */
+void ccontrol_arena_rewind(struct ccontrol_zone *, size_t);
+
+/* Fixed size object pools:
+ * a pool cuts objects of a single size from big blocks of its zone,
+ * without any per-object header. Objects are aligned on align, or
+ * only on a pointer for 0: ask for a cache line to keep objects from
+ * sharing lines. Allocation and free are O(1).
+ * Pools are not thread-safe.
+ */
+struct ccontrol_pool;
+
+/* creates a pool of objsize objects inside a zone */
+struct ccontrol_pool *ccontrol_pool_create(struct ccontrol_zone *, size_t, size_t);
+
+/* frees all objects and gives the memory back to the zone */
+void ccontrol_pool_destroy(struct ccontrol_pool *);
+
+/* allocates an object */
+void *ccontrol_pool_alloc(struct ccontrol_pool *);
+
+/* frees an object */
+void ccontrol_pool_free(struct ccontrol_pool *, void *);
+
 /* translate string to color_set
  * format is like cpusets : "1-4,5"
  */
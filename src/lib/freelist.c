@@ -8,159 +8,291 @@
  * Author: Swann Perarnau <swann.perarnau@imag.fr>
  */
 #include"freelist.h"
+#include<stdint.h>
 #include<string.h>
 /* this freelist is a classical in memory allocator:
- * the start of the memory contains a dummy fl:
- * head.size gives the available size.
- * it saves the size of available memory and the head
- * of the fl.
+ * the start of the memory contains a struct fl_head,
+ * saving the available size and the heads of the
+ * free lists. Blocks follow it, and a dummy allocated
+ * header marks the end of the zone.
  *
- * This allocator applies a first fit to decide which memory
- * to allocate.
+ * Free blocks are segregated by size: each class has its own
+ * list, and a bitmap tells which lists are not empty, so that
+ * finding a fitting block does not depend on the number of free
+ * blocks.
+ *
+ * Each header tells if its block and the previous one are in use,
+ * and free blocks end with their size: a block being freed finds
+ * both its neighbours directly, two free blocks are never adjacent.
  */
 
-
 /* due to the struct size, an allocation must have a minimum
- * size and be aligned on the struct. */
-static size_t fl_adjustsize(size_t size)
+ * size and be aligned on the struct.
+ * Returns 0 if the size is too big to be represented. */
+size_t fl_adjustsize(size_t size)
 {
-	if(size < HEADER_SIZE)
-		return sizeof(fl);
-	else
-		return ((size + HEADER_SIZE + ALIGN_MASK) & ~ALIGN_MASK);
+	if(size > SIZE_MAX - HEADER_SIZE - ALIGN_MASK)
+		return 0;
+	size = (size + HEADER_SIZE + ALIGN_MASK) & ~ALIGN_MASK;
+	if(size < FL_MINSIZE)
+		return FL_MINSIZE;
+	return size;
 }
 
-/* find an adequate region for allocation,
- * if a region is found, prev has a value */
-static void fl_findfit(fl * head, size_t size, fl **res,fl **prev)
+static inline unsigned int fl_log2(size_t size)
 {
-	fl *it,*old;
-	it = head->next;
-	old = head;
-	while(it != NULL)
-	{
-		if(it->size >= size)
-		{
-			*res = it;
-			*prev = old;
-			return;
-		}
-		old = it;
-		it = it->next;
-	}
-	*res = NULL;
-	*prev = NULL;
+	return 8*sizeof(unsigned long) - 1 - __builtin_clzl((unsigned long)size);
 }
 
-/* find the elt before f, f isn't inside the freelist. */
-static fl* fl_findprevious(fl *head, fl *f)
+/* size class of a block */
+static unsigned int fl_binindex(size_t size)
 {
-	fl *it,*prev;
-	it = head->next;
-	prev = head;
-	while(it != NULL)
-	{
-		if(it >  f)
-			return prev;
-		prev = it;
-		it = it->next;
-	}
-	/* since we didn't find it before a fl, it must be after the last one */
-	return prev;
+	unsigned int i;
+	if(size < FL_SMALLLIMIT)
+		return size / FL_ALIGN;
+	i = FL_SMALLBINS + fl_log2(size) - fl_log2(FL_SMALLLIMIT);
+	if(i >= FL_NBINS)
+		return FL_NBINS -1;
+	return i;
+}
+
+/* first block of the zone, right after the head */
+static fl* fl_first(void *z)
+{
+	return (fl *)((char *)z + ALLOCATOR_OVERHEAD - 2*HEADER_SIZE);
+}
+
+static inline fl* fl_next(fl *f)
+{
+	return (fl *)((char *)f + FL_SIZE(f));
+}
+
+/* mark a block as free: set its boundary tag and tell the next block */
+static void fl_setfree(fl *f)
+{
+	fl *next = fl_next(f);
+	f->size &= ~FL_INUSE;
+	FL_PREVSIZE(next) = FL_SIZE(f);
+	next->size &= ~FL_PREVINUSE;
+}
+
+/* insert a free block in its size class */
+static void fl_insert(struct fl_head *head, fl *f)
+{
+	unsigned int i = fl_binindex(FL_SIZE(f));
+	f->prev = NULL;
+	f->next = head->bins[i];
+	if(f->next != NULL)
+		f->next->prev = f;
+	head->bins[i] = f;
+	head->binmap |= 1ULL << i;
+}
+
+/* remove a free block from its size class */
+static void fl_unlink(struct fl_head *head, fl *f)
+{
+	unsigned int i = fl_binindex(FL_SIZE(f));
+	if(f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		head->bins[i] = f->next;
+	if(f->next != NULL)
+		f->next->prev = f->prev;
+	if(head->bins[i] == NULL)
+		head->binmap &= ~(1ULL << i);
+}
+
+/* find an adequate region for allocation.
+ * Small classes contain blocks of a single size, the first
+ * non empty class at or above the one of size gives us a block.
+ * Bigger classes contain blocks of different sizes, we only
+ * check the first block of the class before looking at bigger
+ * classes, and scan the class only if nothing bigger is available.
+ */
+static fl* fl_findfit(struct fl_head *head, size_t size)
+{
+	fl *it;
+	unsigned long long map;
+	unsigned int i = fl_binindex(size);
+
+	it = head->bins[i];
+	if(it != NULL && (i < FL_SMALLBINS || FL_SIZE(it) >= size))
+		return it;
+
+	map = head->binmap & ~((2ULL << i) - 1);
+	if(map != 0)
+		return head->bins[__builtin_ctzll(map)];
+
+	for(; it != NULL; it = it->next)
+		if(FL_SIZE(it) >= size)
+			return it;
+	return NULL;
 }
 
 /* initialize the memory zone as if it was the beginning of the memory region,
  * no argument checking.*/
 int fl_init(void *z, size_t size)
 {
-	fl *head,*next;
-	head = (fl *)z;
-	next = head+1;
-	next->size = size - sizeof(*head);
-	next->next = NULL;
-	head->size = size - sizeof(*head);
-	head->next = next;
+	struct fl_head *head;
+	fl *first,*end;
+	if(size < ALLOCATOR_OVERHEAD + FL_MINSIZE - HEADER_SIZE)
+		return 1;
+	head = (struct fl_head *)z;
+	memset(head,0,sizeof(*head));
+	first = fl_first(z);
+	first->size = ((size - ALLOCATOR_OVERHEAD + HEADER_SIZE) & ~ALIGN_MASK) | FL_PREVINUSE;
+	end = fl_next(first);
+	end->size = FL_INUSE;
+	fl_setfree(first);
+	head->size = FL_SIZE(first);
+	fl_insert(head,first);
+	return 0;
+}
+
+/* the dummy header at the end of the zone becomes the header of the
+ * new memory, freeing it merges it with the last free block.
+ */
+int fl_extend(void *z, size_t oldsize, size_t newsize)
+{
+	fl *f,*end;
+	if(((oldsize | newsize) & ALIGN_MASK) != 0 || newsize < oldsize + FL_MINSIZE)
+		return 1;
+	f = (fl *)((char *)z + oldsize - HEADER_SIZE);
+	f->size = (newsize - oldsize) | (f->size & FL_PREVINUSE) | FL_INUSE;
+	end = fl_next(f);
+	end->size = FL_INUSE | FL_PREVINUSE;
+	fl_free(z,FL_TO_VOID(f));
+	return 0;
+}
+
+/* runs of pages become blocks, their headers sit at the end of the
+ * previous page like the end of the zone does. Runs alternate between
+ * usable and unusable ones, so free blocks never touch each other.
+ */
+int fl_init_pages(void *z, size_t size, size_t pgsize,
+		int (*ok)(void *, size_t), void *arg)
+{
+	struct fl_head *head;
+	fl *f;
+	size_t i,j,nbpages;
+	size_t prev = FL_PREVINUSE;
+	int cur;
+	if(pgsize == 0 || (pgsize & ALIGN_MASK) != 0 || size % pgsize != 0
+			|| pgsize < ALLOCATOR_OVERHEAD + FL_MINSIZE)
+		return 1;
+	head = (struct fl_head *)z;
+	memset(head,0,sizeof(*head));
+	nbpages = size / pgsize;
+	f = fl_first(z);
+	for(i = 0; i < nbpages; i = j)
+	{
+		cur = ok(arg,i) != 0;
+		for(j = i+1; j < nbpages && (ok(arg,j) != 0) == cur; j++);
+		f->size = ((char *)z + j*pgsize - HEADER_SIZE - (char *)f) | prev | FL_INUSE;
+		if(cur)
+		{
+			fl_setfree(f);
+			head->size += FL_SIZE(f);
+			fl_insert(head,f);
+			prev = 0;
+		}
+		else
+			prev = FL_PREVINUSE;
+		f = fl_next(f);
+	}
+	f->size = FL_INUSE | prev;
 	return 0;
 }
 
 void *fl_allocate(void *z, size_t size)
 {
-	fl *f,*prev,*head;
-	void *p;
+	fl *f,*rest;
+	struct fl_head *head;
 	if(size == 0)
 		return NULL;
 
 	size = fl_adjustsize(size);
-	head = (fl*)z;
-	if(size > head->size)
+	head = (struct fl_head *)z;
+	if(size == 0 || size > head->size)
 		return NULL;
 
 	/* find a fitting free zone */
-	fl_findfit(head,size,&f,&prev);
+	f = fl_findfit(head,size);
 	if(f == NULL)
 		return NULL;
+	fl_unlink(head,f);
 
-	/* update the zone */
-	if(f->size - size < sizeof(fl))
+	/* give back what we do not need, the block after the rest
+	 * already knows its previous block is free */
+	if(FL_SIZE(f) - size >= FL_MINSIZE)
 	{
-		prev->next = f->next;
-		p = FL_TO_VOID(f);
+		rest = (fl *)((char *)f + size);
+		rest->size = (FL_SIZE(f) - size) | FL_PREVINUSE;
+		fl_setfree(rest);
+		fl_insert(head,rest);
+		f->size = size | (f->size & FL_PREVINUSE);
 	}
 	else
-	{
-		/* resize the region, then jump to the new one */
-		f->size -= size;
-		f =(fl *)((char *) f + f->size);
-		f->size = size;
-		p = FL_TO_VOID(f);
-	}
+		fl_next(f)->size |= FL_PREVINUSE;
 	/* update head size */
-	head->size -= size;
-	return p;
+	head->size -= FL_SIZE(f);
+	f->size |= FL_INUSE;
+	return FL_TO_VOID(f);
 }
 
 
 void fl_free(void *z, void *p)
 {
-	fl *f,*prev,*next,*head;
+	fl *f,*prev,*next;
+	struct fl_head *head;
 	if(p == NULL)
 		return;
 
 	f = VOID_TO_FL(p);
-	f->next = NULL;
-	head = (fl *)z;
-
-	head->size += f->size;
-	/* this function also merge the newly free region
-	 * with the other ones
-	 */
+	head = (struct fl_head *)z;
+	head->size += FL_SIZE(f);
 
-	/* find previous region  */
-	prev = fl_findprevious(head,f);
-	if(prev != head && (fl *)((char *)prev + prev->size) == f)
+	/* merge the previous region if it is free */
+	if(!(f->size & FL_PREVINUSE))
 	{
-		/* merge regions */
-		prev->size += f->size;
+		prev = (fl *)((char *)f - FL_PREVSIZE(f));
+		fl_unlink(head,prev);
+		prev->size += FL_SIZE(f);
 		f = prev;
 	}
-	else
-	{
-		f->next = prev->next;
-		prev->next = f;
-	}
-	/* merge next region if necessary */
-	next = f->next;
-	if(next != NULL && (fl *)((char *)f + f->size) == next)
+	/* merge the next region if it is free */
+	next = fl_next(f);
+	if(!(next->size & FL_INUSE))
 	{
-		f->size += next->size;
-		f->next = next->next;
+		fl_unlink(head,next);
+		f->size += FL_SIZE(next);
 	}
+	fl_setfree(f);
+	fl_insert(head,f);
 }
 
+/* cut an allocated block down to size, freeing the end of it */
+static void fl_shrink(void *z, fl *f, size_t size)
+{
+	fl *rest;
+	if(FL_SIZE(f) - size < FL_MINSIZE)
+		return;
+	rest = (fl *)((char *)f + size);
+	rest->size = (FL_SIZE(f) - size) | FL_INUSE | FL_PREVINUSE;
+	f->size = size | (f->size & FL_FLAGS);
+	fl_free(z,FL_TO_VOID(rest));
+}
+
+/* realloc tries to stay in place: shrinking only frees the end of
+ * the block, growing takes the free blocks around it if they are big
+ * enough. Only then do we allocate a new block and copy.
+ */
 void *fl_realloc(void *z, void *p, size_t size)
 {
 	void *ret;
-	fl *f;
+	fl *f,*prev,*next;
+	size_t avail,nsize;
+	struct fl_head *head = (struct fl_head *)z;
 	if(p == NULL)
 		return fl_allocate(z,size);
 
@@ -170,11 +302,181 @@ void *fl_realloc(void *z, void *p, size_t size)
 		return NULL;
 	}
 
+	nsize = fl_adjustsize(size);
+	if(nsize == 0)
+		return NULL;
+	f = VOID_TO_FL(p);
+	if(nsize <= FL_SIZE(f))
+	{
+		fl_shrink(z,f,nsize);
+		return p;
+	}
+
+	/* grow into the next block */
+	next = fl_next(f);
+	avail = FL_SIZE(f);
+	if(!(next->size & FL_INUSE))
+		avail += FL_SIZE(next);
+	if(avail >= nsize)
+	{
+		fl_unlink(head,next);
+		head->size -= FL_SIZE(next);
+		f->size += FL_SIZE(next);
+		fl_next(f)->size |= FL_PREVINUSE;
+		fl_shrink(z,f,nsize);
+		return p;
+	}
+
+	/* grow into the previous one (and the next), moving the data */
+	if(!(f->size & FL_PREVINUSE))
+	{
+		prev = (fl *)((char *)f - FL_PREVSIZE(f));
+		if(avail + FL_SIZE(prev) >= nsize)
+		{
+			fl_unlink(head,prev);
+			head->size -= FL_SIZE(prev);
+			if(!(next->size & FL_INUSE))
+			{
+				fl_unlink(head,next);
+				head->size -= FL_SIZE(next);
+			}
+			prev->size += avail;
+			prev->size |= FL_INUSE;
+			fl_next(prev)->size |= FL_PREVINUSE;
+			ret = memmove(FL_TO_VOID(prev),p,FL_SIZE(f) - HEADER_SIZE);
+			fl_shrink(z,prev,nsize);
+			return ret;
+		}
+	}
+
 	ret = fl_allocate(z,size);
 	if(ret != NULL)
 	{
-		ret = memcpy(ret,p,size);
+		ret = memcpy(ret,p,FL_SIZE(f) - HEADER_SIZE);
 		fl_free(z,p);
 	}
 	return ret;
 }
+
+/* aligned allocation: we ask for enough memory to find an aligned
+ * address far enough from the start of the block for the space before
+ * it to be a valid block. Both the space before and after the
+ * aligned block are then given back.
+ */
+void *fl_memalign(void *z, size_t align, size_t size)
+{
+	fl *f,*g;
+	char *p,*q;
+	size_t nsize;
+	if(align <= FL_ALIGN)
+		return fl_allocate(z,size);
+	if(size == 0 || (align & (align -1)) != 0)
+		return NULL;
+	nsize = fl_adjustsize(size);
+	if(nsize == 0 || nsize > SIZE_MAX - align - FL_MINSIZE)
+		return NULL;
+	p = fl_allocate(z,nsize + align + FL_MINSIZE);
+	if(p == NULL)
+		return NULL;
+	f = VOID_TO_FL(p);
+	if(((size_t)p & (align -1)) == 0)
+	{
+		fl_shrink(z,f,nsize);
+		return p;
+	}
+	q = (char *)(((size_t)p + FL_MINSIZE + align -1) & ~(align -1));
+	g = VOID_TO_FL(q);
+	g->size = (FL_SIZE(f) - (q - p)) | FL_INUSE | FL_PREVINUSE;
+	f->size = (q - p) | (f->size & FL_FLAGS);
+	fl_free(z,p);
+	fl_shrink(z,g,nsize);
+	return q;
+}
+
+/* find a place for a block of nsize bytes inside the free block f,
+ * using only allowed pages. The block found must leave either
+ * nothing or a valid block before it.
+ */
+static fl *fl_fitpages(void *z, fl *f, size_t nsize, size_t pgsize,
+		int (*ok)(void *, size_t), void *arg)
+{
+	char *start = (char *)f, *end = (char *)f + FL_SIZE(f);
+	char *run,*limit,*g;
+	size_t pg = (start - (char *)z) / pgsize;
+	while((char *)z + pg*pgsize < end)
+	{
+		if(!ok(arg,pg))
+		{
+			pg++;
+			continue;
+		}
+		/* a run of allowed pages */
+		run = (char *)z + pg*pgsize;
+		while((char *)z + pg*pgsize < end && ok(arg,pg))
+			pg++;
+		limit = (char *)z + pg*pgsize;
+		if(limit > end)
+			limit = end;
+		/* pages are aligned, so is the block header after it */
+		g = run <= start ? start : run + HEADER_SIZE;
+		if(g != start && (size_t)(g - start) < FL_MINSIZE)
+			g = start + FL_MINSIZE;
+		if(g < limit && (size_t)(limit - g) >= nsize)
+			return (fl *)g;
+	}
+	return NULL;
+}
+
+/* allocation restricted to some pages of the zone: we look at all
+ * the free blocks big enough, and cut the block from the first run
+ * of allowed pages that can hold it.
+ */
+void *fl_allocate_pages(void *z, size_t size, size_t pgsize,
+		int (*ok)(void *, size_t), void *arg)
+{
+	fl *f,*g;
+	unsigned long long map;
+	unsigned int i;
+	size_t nsize;
+	struct fl_head *head = (struct fl_head *)z;
+	if(size == 0 || pgsize == 0 || (pgsize & ALIGN_MASK) != 0)
+		return NULL;
+	nsize = fl_adjustsize(size);
+	if(nsize == 0 || nsize > head->size)
+		return NULL;
+
+	map = head->binmap & ~((1ULL << fl_binindex(nsize)) - 1);
+	for(; map != 0; map &= map - 1)
+	{
+		i = __builtin_ctzll(map);
+		for(f = head->bins[i]; f != NULL; f = f->next)
+		{
+			if(FL_SIZE(f) < nsize)
+				continue;
+			g = fl_fitpages(z,f,nsize,pgsize,ok,arg);
+			if(g == NULL)
+				continue;
+			/* allocate all of f, then give back what is around g */
+			fl_unlink(head,f);
+			head->size -= FL_SIZE(f);
+			f->size |= FL_INUSE;
+			fl_next(f)->size |= FL_PREVINUSE;
+			if(g != f)
+			{
+				g->size = (FL_SIZE(f) - ((char *)g - (char *)f)) | FL_INUSE | FL_PREVINUSE;
+				f->size = ((char *)g - (char *)f) | (f->size & FL_FLAGS);
+				fl_free(z,FL_TO_VOID(f));
+			}
+			fl_shrink(z,g,nsize);
+			return FL_TO_VOID(g);
+		}
+	}
+	return NULL;
+}
+
+size_t fl_usable_size(void *p)
+{
+	if(p == NULL)
+		return 0;
+	return FL_SIZE(VOID_TO_FL(p)) - HEADER_SIZE;
+}
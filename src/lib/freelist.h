@@ -12,12 +12,18 @@
 
 #include<stdlib.h>
 
-/* a free list elt, indicating a free slot inside
- * a zone.
+/* a free list elt, indicating a slot inside a zone.
+ * The size field is the header of every block, allocated or not.
+ * Its low bits are flags (blocks sizes are always aligned).
+ * The links are only valid for free blocks: they chain together
+ * free blocks of the same size class.
+ * Free blocks also end with a copy of their size (a boundary tag),
+ * so that the block after them can find them when it is freed.
  */
 struct fl_elt {
 	size_t size;
 	struct fl_elt* next;
+	struct fl_elt* prev;
 };
 typedef struct fl_elt fl;
 
@@ -25,25 +31,96 @@ typedef struct fl_elt fl;
 #define FL_TO_VOID(x)	(void *)((char *) x + HEADER_SIZE)
 #define VOID_TO_FL(x)	(fl *)((char *)x - HEADER_SIZE)
 
+/* block flags, stored in the low bits of the size field */
+#define FL_INUSE	((size_t)1)
+#define FL_PREVINUSE	((size_t)2)
+#define FL_FLAGS	(FL_INUSE | FL_PREVINUSE)
+#define FL_SIZE(f)	((f)->size & ~FL_FLAGS)
+/* the boundary tag of the block before f, only valid if it is free */
+#define FL_PREVSIZE(f)	(*((size_t *)(f) - 1))
+
+/* blocks are aligned so that the memory returned to the user is
+ * aligned on two words (like glibc does). Free blocks must also be
+ * big enough to hold the links and the boundary tag.
+ * Allocated blocks do not need the tag, the overhead of an allocation
+ * is only its header.
+ */
+#define FL_ALIGN	(2*sizeof(size_t))
+#define ALIGN_MASK	(FL_ALIGN-((size_t)1))
+#define FL_MINSIZE	((sizeof(fl) + HEADER_SIZE + ALIGN_MASK) & ~ALIGN_MASK)
+
+/* size classes: small blocks have one class per possible size,
+ * bigger ones a class per power of two. The last class holds all
+ * blocks too big for the others.
+ */
+#define FL_NBINS	64
+#define FL_SMALLBINS	32
+#define FL_SMALLLIMIT	(FL_SMALLBINS*FL_ALIGN)
+
+/* the head of the zone: saves the available size, the size classes
+ * and a bitmap of the non empty ones.
+ */
+struct fl_head {
+	size_t size;
+	unsigned long long binmap;
+	fl *bins[FL_NBINS];
+};
+
 /* the memory allocator overhead (minimum size you require for the
- * allocator to work.
- * Since our allocator uses a dummy head, we need a full struct
- * plus the overhead of a single allocation.
+ * allocator to work).
+ * We need the head, the header of a single allocation and a dummy
+ * header marking the end of the zone.
+ * This assumes the zone is aligned on FL_ALIGN and its size is a
+ * multiple of it.
  */
-#define ALIGN_MASK (sizeof(fl)-((size_t)1))
-#define ALLOCATOR_OVERHEAD ((sizeof(fl) + HEADER_SIZE + ALIGN_MASK) & ~ALIGN_MASK)
+#define ALLOCATOR_OVERHEAD (((sizeof(struct fl_head) + HEADER_SIZE + ALIGN_MASK) & ~ALIGN_MASK) + HEADER_SIZE)
 /* free_list code: a free_list is a list of free memory regions
  * inside a zone. It is managed inside the zone memory.
  */
 
-/* initialize the free list, creating the dummy head and setting
+/* initialize the free list, creating the head and setting
  * the size of the first region.
+ * Returns 1 if the zone is too small.
  */
 int fl_init(void *z, size_t size);
 
+/* initialize the free list, only using some pages of the zone:
+ * ok(arg,i) tells if the i-th page (of pgsize bytes) can be used.
+ * Other pages are kept in blocks that are never allocated, their only
+ * use is the header of the block after them.
+ * The size must be a multiple of pgsize.
+ * Returns 1 if the zone or the pages are too small.
+ */
+int fl_init_pages(void *z, size_t size, size_t pgsize,
+		int (*ok)(void *, size_t), void *arg);
+
+/* gives more memory to the allocator: the zone now ends at newsize.
+ * Both sizes must be multiples of FL_ALIGN.
+ * Returns 1 if the zone cannot be extended that way.
+ */
+int fl_extend(void *z, size_t oldsize, size_t newsize);
+
+/* size of the block an allocation of size bytes uses,
+ * 0 if it cannot be allocated */
+size_t fl_adjustsize(size_t size);
+
 void *fl_allocate(void *z, size_t size);
 
 void fl_free(void *z, void *p);
 
 void *fl_realloc(void *z, void *p, size_t size);
+
+/* allocate size bytes aligned on align (a power of two) */
+void *fl_memalign(void *z, size_t align, size_t size);
+
+/* allocate size bytes using only some pages of the zone:
+ * ok(arg,i) tells if the i-th page (of pgsize bytes) of the zone
+ * can be used. Slower than fl_allocate, all big enough free blocks
+ * might be scanned.
+ */
+void *fl_allocate_pages(void *z, size_t size, size_t pgsize,
+		int (*ok)(void *, size_t), void *arg);
+
+/* how many bytes the allocation can really hold */
+size_t fl_usable_size(void *p);
 #endif /* FREELIST_H */
@@ -12,6 +12,8 @@
 
 #include<ctype.h>
 #include<errno.h>
+#include<malloc.h>
+#include<sched.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
@@ -19,24 +21,65 @@
 #include<unistd.h>
 
 /* Dynamic memory allocations bypass : this code
- * redefines malloc, calloc, realloc and free to provide
- * LD_PRELOAD features.
+ * redefines malloc, calloc, realloc and free, and the aligned
+ * allocation functions of glibc, to provide LD_PRELOAD features.
  * All memory allocations will go in a single zone using
- * this code.
+ * this code. The zone is thread-safe, unless told otherwise.
+ *
+ * If the color set contains several sets separated by ':',
+ * each thread gets its own zone instead, created on its first
+ * allocation. Sets are given to threads in round robin, in the order
+ * threads first allocate. Memory freed by another thread goes back to
+ * the zone it comes from.
  *
  * Two environment variables must be defined:
- * CCONTROL_PSET: gives the color set to use.
- * CCONTROL_SIZE: gives the allocation size to ask.
+ * CCONTROL_PSET: gives the color set(s) to use.
+ * CCONTROL_SIZE: gives the allocation size to ask (for each zone).
+ * Optional ones:
+ * CCONTROL_THREADSAFE: set to 0 if the application is single threaded.
+ * CCONTROL_ARENA: set to 1 to use arena zones, memory is then never
+ * reused.
+ * CCONTROL_GROW: set to 1 to let zones grow when they are full,
+ * CCONTROL_SIZE is then only their initial size.
+ * CCONTROL_POPULATE: set to 1 to map all the zone pages at creation.
+ * CCONTROL_NODE: NUMA node the zones take their pages from, or "local"
+ * for the node of the thread creating the zone.
+ * CCONTROL_BACKEND: set to hugetlb to build zones from huge pages,
+ * without the module (see ccontrol.h). Unless the color set is
+ * contiguous, mallocs bigger than the longest run of pages of the set
+ * fail with ENOMEM, a warning is printed on the first one.
  */
 
 extern struct ccontrol_zone local_zone;
+extern struct ccontrol_zone *local_thread_zone(unsigned int);
 unsigned short init_ok = 0;
 unsigned short in_init = 0;
 
+/* per-thread zones info */
+#define PSETS_MAXLEN 4096
+static color_set csets[CCONTROL_MAX_THREAD_ZONES];
+static unsigned int nbcsets = 0;
+static size_t zone_size;
+static int zone_flags;
+static int zone_node = CCONTROL_NODE_ANY;
+static unsigned int nbzones = 0;
+static int zone_ready[CCONTROL_MAX_THREAD_ZONES];
+static __thread struct ccontrol_zone *thread_zone = NULL;
+
 static void cleanup()
 {
 	int err;
+	unsigned int i,n;
 	if(init_ok) {
+		if(nbcsets > 1)
+		{
+			n = nbzones < CCONTROL_MAX_THREAD_ZONES ? nbzones : CCONTROL_MAX_THREAD_ZONES;
+			for(i = 0; i < n; i++)
+				if(zone_ready[i])
+					ccontrol_destroy_zone(local_thread_zone(i));
+			init_ok = 0;
+			return;
+		}
 		err = ccontrol_destroy_zone(&local_zone);
 		if(err)
 			_exit(EXIT_FAILURE);
@@ -44,11 +87,34 @@ static void cleanup()
 	}
 }
 
+/* parse a list of color sets separated by ':' */
+static int parse_psets(char *str)
+{
+	static char buf[PSETS_MAXLEN];
+	char *cur,*sep;
+	if(strlen(str) >= PSETS_MAXLEN)
+		return 1;
+	strcpy(buf,str);
+	cur = buf;
+	nbcsets = 0;
+	do {
+		if(nbcsets == CCONTROL_MAX_THREAD_ZONES)
+			return 1;
+		sep = strchr(cur,CCONTROL_PSET_SEPARATOR);
+		if(sep != NULL)
+			*sep = '\0';
+		if(ccontrol_str2cset(&csets[nbcsets],cur))
+			return 1;
+		nbcsets++;
+		cur = sep + 1;
+	} while(sep != NULL);
+	return 0;
+}
+
 static void init()
 {
-	char *env_pset, *env_size;
-	color_set c;
-	size_t size;
+	char *env_pset, *env_size, *env_ts, *env_arena, *env_grow, *env_pop, *env_node;
+	char *end;
 	int err;
 
 	in_init = 1;
@@ -76,8 +142,8 @@ static void init()
 		exit(EXIT_FAILURE);
 	}
 
-	/* parse colors into colorset */
-	err = ccontrol_str2cset(&c,env_pset);
+	/* parse colors into colorsets */
+	err = parse_psets(env_pset);
 	if(err)
 	{
 		fprintf(stderr,"ccontrol: invalid colorset in %s\n",CCONTROL_ENV_PARTITION_COLORSET);
@@ -85,7 +151,7 @@ static void init()
 	}
 
 	/* parse size */
-	err = ccontrol_str2size(&size,env_size);
+	err = ccontrol_str2size(&zone_size,env_size);
 	if(err)
 	{
 		fprintf(stderr,"ccontrol: invalid size in %s, %s\n",CCONTROL_ENV_SIZE,
@@ -93,17 +159,103 @@ static void init()
 		exit(EXIT_FAILURE);
 	}
 
-	/* allocate zone */
-	err = ccontrol_create_zone(&local_zone,&c,size);
-	if(err)
+	zone_flags = CCONTROL_ZONE_THREADSAFE;
+	env_ts = getenv(CCONTROL_ENV_THREADSAFE);
+	if(env_ts != NULL && !strcmp(env_ts,"0") && nbcsets == 1)
+		zone_flags = 0;
+	env_arena = getenv(CCONTROL_ENV_ARENA);
+	if(env_arena != NULL && !strcmp(env_arena,"1"))
+		zone_flags |= CCONTROL_ZONE_ARENA;
+	env_grow = getenv(CCONTROL_ENV_GROW);
+	if(env_grow != NULL && !strcmp(env_grow,"1") && !(zone_flags & CCONTROL_ZONE_ARENA))
+		zone_flags |= CCONTROL_ZONE_GROW;
+	env_pop = getenv(CCONTROL_ENV_POPULATE);
+	if(env_pop != NULL && !strcmp(env_pop,"1"))
+		zone_flags |= CCONTROL_ZONE_POPULATE;
+	env_node = getenv(CCONTROL_ENV_NODE);
+	if(env_node != NULL)
 	{
-		fprintf(stderr,"ccontrol: failed to allocate global zone\n");
-		exit(EXIT_FAILURE);
+		if(!strcmp(env_node,"local"))
+			zone_node = CCONTROL_NODE_LOCAL;
+		else
+		{
+			zone_node = strtol(env_node,&end,10);
+			if(*env_node == '\0' || *end != '\0' || zone_node < 0)
+			{
+				fprintf(stderr,"ccontrol: invalid node in %s\n",CCONTROL_ENV_NODE);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	/* allocate zone, per-thread ones are created on demand */
+	if(nbcsets == 1)
+	{
+		err = ccontrol_create_zone_node(&local_zone,&csets[0],zone_size,zone_flags,zone_node);
+		if(err)
+		{
+			fprintf(stderr,"ccontrol: failed to allocate global zone\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 	in_init = 0;
 	init_ok = 1;
 }
 
+/* the zone the calling thread allocates from */
+static struct ccontrol_zone *get_zone(void)
+{
+	unsigned int i;
+	struct ccontrol_zone *z;
+	if(nbcsets == 1)
+		return &local_zone;
+	if(thread_zone != NULL)
+		return thread_zone;
+
+	i = __atomic_fetch_add(&nbzones,1,__ATOMIC_RELAXED);
+	if(i >= CCONTROL_MAX_THREAD_ZONES)
+	{
+		/* share a zone, wait for its creation to be complete */
+		i %= CCONTROL_MAX_THREAD_ZONES;
+		while(!__atomic_load_n(&zone_ready[i],__ATOMIC_ACQUIRE))
+			sched_yield();
+		thread_zone = local_thread_zone(i);
+		return thread_zone;
+	}
+	z = local_thread_zone(i);
+	if(ccontrol_create_zone_node(z,&csets[i % nbcsets],zone_size,zone_flags,zone_node))
+	{
+		fprintf(stderr,"ccontrol: failed to allocate zone of thread %u\n",i);
+		exit(EXIT_FAILURE);
+	}
+	__atomic_store_n(&zone_ready[i],1,__ATOMIC_RELEASE);
+	thread_zone = z;
+	return z;
+}
+
+/* the zone a pointer comes from, NULL for memory we do not own */
+static struct ccontrol_zone *find_zone(void *ptr)
+{
+	unsigned int i,n;
+	struct ccontrol_zone *z;
+	if(nbcsets == 1)
+		return &local_zone;
+	if(ccontrol_zone_contains(thread_zone,ptr))
+		return thread_zone;
+	n = __atomic_load_n(&nbzones,__ATOMIC_RELAXED);
+	if(n > CCONTROL_MAX_THREAD_ZONES)
+		n = CCONTROL_MAX_THREAD_ZONES;
+	for(i = 0; i < n; i++)
+	{
+		if(!__atomic_load_n(&zone_ready[i],__ATOMIC_ACQUIRE))
+			continue;
+		z = local_thread_zone(i);
+		if(ccontrol_zone_contains(z,ptr))
+			return z;
+	}
+	return NULL;
+}
+
 #define MMAP(s) mmap(NULL,s,PROT_READ|PROT_WRITE|PROT_EXEC,MAP_PRIVATE|MAP_ANONYMOUS,-1,0)
 void * malloc(size_t size)
 {
@@ -111,7 +263,7 @@ void * malloc(size_t size)
 		return MMAP(size);
 	if(!init_ok)
 		init();
-	return ccontrol_malloc(&local_zone,size);
+	return ccontrol_malloc(get_zone(),size);
 }
 
 void free(void * ptr)
@@ -120,7 +272,9 @@ void free(void * ptr)
 		return;
 	if(!init_ok)
 		init();
-	ccontrol_free(&local_zone,ptr);
+	if(ptr == NULL)
+		return;
+	ccontrol_free(find_zone(ptr),ptr);
 }
 
 void * realloc(void *ptr, size_t size)
@@ -132,7 +286,9 @@ void * realloc(void *ptr, size_t size)
 	}
 	if(!init_ok)
 		init();
-	return ccontrol_realloc(&local_zone,ptr,size);
+	if(ptr == NULL)
+		return ccontrol_malloc(get_zone(),size);
+	return ccontrol_realloc(find_zone(ptr),ptr,size);
 }
 
 void * calloc(size_t nm, size_t size)
@@ -152,3 +308,61 @@ void * calloc(size_t nm, size_t size)
 		p = memset(p,0,size*nm);
 	return p;
 }
+
+/* aligned allocations */
+static void *aligned_mmap(size_t align, size_t size)
+{
+	char *r = MMAP(size + align);
+	if(r == MAP_FAILED)
+		return NULL;
+	return (void *)(((size_t)r + align -1) & ~(align -1));
+}
+
+void * memalign(size_t align, size_t size)
+{
+	if(in_init)
+		return aligned_mmap(align,size);
+	if(!init_ok)
+		init();
+	return ccontrol_memalign(get_zone(),align,size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *p;
+	if(align % sizeof(void *) != 0 || (align & (align -1)) != 0)
+		return EINVAL;
+	if(size == 0)
+	{
+		*memptr = NULL;
+		return 0;
+	}
+	p = memalign(align,size);
+	if(p == NULL)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+void * aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align,size);
+}
+
+void * valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE),size);
+}
+
+void * pvalloc(size_t size)
+{
+	size_t pg_sz = sysconf(_SC_PAGESIZE);
+	return memalign(pg_sz,(size + pg_sz -1) & ~(pg_sz -1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	if(in_init || !init_ok || ptr == NULL)
+		return 0;
+	return ccontrol_usable_size(find_zone(ptr),ptr);
+}
@@ -0,0 +1,128 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * Copyright (C) 2010 Swann Perarnau
+ * Author: Swann Perarnau <swann.perarnau@imag.fr>
+ */
+#include"ccontrol.h"
+
+#include<stdint.h>
+/* fixed size object pools:
+ * a pool takes big blocks (slabs) from its zone and cuts them in
+ * objects of the same size. Objects have no header: the only metadata
+ * inside a slab is a link to the previous slab, at its beginning.
+ * Free objects are linked together by their first word, allocation
+ * and free just pop and push on this list. Objects that were never
+ * allocated are taken from the end of the current slab.
+ */
+
+/* we try to get slabs of that size from the zone,
+ * but use smaller ones if the zone cannot give it */
+#define POOL_SLABSIZE (64*1024)
+#define POOL_MINOBJS 16
+
+struct ccontrol_pool {
+	struct ccontrol_zone *z;
+	size_t objsize; /* size of an object, multiple of align */
+	size_t align;
+	size_t offset; /* offset of the first object in a slab */
+	void *free; /* free objects list */
+	char *slab; /* last slab allocated, first word links to the previous one */
+	size_t next; /* offset of the first unused object in slab */
+	size_t end; /* size of slab */
+};
+
+struct ccontrol_pool *ccontrol_pool_create(struct ccontrol_zone *z, size_t objsize, size_t align)
+{
+	struct ccontrol_pool *p;
+	if(z == NULL || objsize == 0)
+		return NULL;
+	/* objects are packed by default, the free list link is the
+	 * only alignment they need */
+	if(align < sizeof(void *))
+		align = sizeof(void *);
+	if((align & (align -1)) != 0 || objsize > SIZE_MAX/2)
+		return NULL;
+
+	p = (struct ccontrol_pool *) malloc(sizeof(struct ccontrol_pool));
+	if(p == NULL)
+		return NULL;
+	p->z = z;
+	p->align = align;
+	p->objsize = (objsize + align -1) & ~(align -1);
+	p->offset = (sizeof(void *) + align -1) & ~(align -1);
+	p->free = NULL;
+	p->slab = NULL;
+	p->next = 0;
+	p->end = 0;
+	return p;
+}
+
+void ccontrol_pool_destroy(struct ccontrol_pool *p)
+{
+	char *s;
+	if(p == NULL)
+		return;
+	while(p->slab != NULL)
+	{
+		s = p->slab;
+		p->slab = *(char **)s;
+		ccontrol_free(p->z,s);
+	}
+	free(p);
+}
+
+/* get a new slab from the zone */
+static int pool_grow(struct ccontrol_pool *p)
+{
+	char *s;
+	size_t size = POOL_SLABSIZE;
+	if(size < p->offset + POOL_MINOBJS*p->objsize)
+		size = p->offset + POOL_MINOBJS*p->objsize;
+	while(1)
+	{
+		s = ccontrol_memalign(p->z,p->align,size);
+		if(s != NULL)
+			break;
+		if(size == p->offset + p->objsize)
+			return 1;
+		size /= 2;
+		if(size < p->offset + p->objsize)
+			size = p->offset + p->objsize;
+	}
+	*(char **)s = p->slab;
+	p->slab = s;
+	p->next = p->offset;
+	p->end = size;
+	return 0;
+}
+
+void *ccontrol_pool_alloc(struct ccontrol_pool *p)
+{
+	void *ret;
+	if(p == NULL)
+		return NULL;
+	if(p->free != NULL)
+	{
+		ret = p->free;
+		p->free = *(void **)ret;
+		return ret;
+	}
+	if(p->slab == NULL || p->next + p->objsize > p->end)
+		if(pool_grow(p))
+			return NULL;
+	ret = p->slab + p->next;
+	p->next += p->objsize;
+	return ret;
+}
+
+void ccontrol_pool_free(struct ccontrol_pool *p, void *obj)
+{
+	if(p == NULL || obj == NULL)
+		return;
+	*(void **)obj = p->free;
+	p->free = obj;
+}
@@ -30,6 +30,21 @@
 #include <linux/sort.h>
 // device bitmap
 #include <linux/bitmap.h>
+// device growth
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+// numa
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+// parallel init
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+// statistics
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+// anonymous devices
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
 // cache info
 #include "colorset.h"
 #include "ioctls.h"
@@ -40,18 +55,61 @@ MODULE_LICENSE("GPL");
 static unsigned long memory = 0;
 static char *mem = "1k";
 module_param(mem,charp,0);
-MODULE_PARM_DESC(mem,"How much memory should I reserve in RAM.");
+MODULE_PARM_DESC(mem,"How much memory should I reserve in RAM, split between NUMA nodes.");
 static unsigned int colors = 1;
 module_param(colors,uint,0);
 MODULE_PARM_DESC(colors,"How many colors are available in cache.");
+static unsigned int fault_around = 16;
+module_param(fault_around,uint,0);
+MODULE_PARM_DESC(fault_around,"How many pages are mapped on each page fault, by default.");
+static char *color_func = "mod";
+module_param(color_func,charp,0);
+MODULE_PARM_DESC(color_func,"How the color of a page is computed: mod, bits or xor.");
+static unsigned long color_masks[IOCTL_MAX_COLOR_MASKS];
+static int nbmasks = 0;
+module_param_array(color_masks,ulong,&nbmasks,0);
+MODULE_PARM_DESC(color_masks,"Page frame number bits used by the color function: a single mask for bits, one per color bit for xor.");
+static int parallel_init = 1;
+module_param(parallel_init,int,0);
+MODULE_PARM_DESC(parallel_init,"Reserve the memory of all NUMA nodes at the same time.");
+static unsigned int init_ms = 0;
+module_param(init_ms,uint,0444);
+MODULE_PARM_DESC(init_ms,"Time taken to reserve the memory, in ms (read only).");
+static int reclaim = 1;
+module_param(reclaim,int,0);
+MODULE_PARM_DESC(reclaim,"Give unused reserved memory back to the kernel under memory pressure.");
+static unsigned int min_per_color = 0;
+module_param(min_per_color,uint,0644);
+MODULE_PARM_DESC(min_per_color,"Free pages of each color a node keeps under memory pressure.");
+static int regrow = 1;
+module_param(regrow,int,0644);
+MODULE_PARM_DESC(regrow,"Reserve again the memory released under pressure when a device needs it.");
+/* we do not map more than that on a single fault */
+#define MAX_FAULT_AROUND 512
 /* need it global because of cleanup code */
 static unsigned int order = 0;
+/* maximum number of pages of a color in a head */
+static unsigned int per_head = 0;
 static struct class *ccontrol_class;
 
-/* helper functions for color management */
+/* helper functions for color management:
+ * for the bits and xor functions, hash[i] selects the pfn bits giving
+ * bit i of the color.
+ */
+static int color_type = IOCTL_COLOR_MOD;
+static unsigned long color_hash[IOCTL_MAX_COLOR_MASKS];
+static unsigned int color_nbits = 0;
+/* the function, as given to users */
+static ioctl_colorfn colorfn;
+
 static inline unsigned int pfn_to_color(unsigned long pfn)
 {
-	return pfn%colors;
+	unsigned int i,c = 0;
+	if(color_type == IOCTL_COLOR_MOD)
+		return pfn%colors;
+	for(i = 0; i < color_nbits; i++)
+		c |= (hweight_long(pfn & color_hash[i]) & 1) << i;
+	return c;
 }
 
 /* devices structures:
@@ -63,9 +121,13 @@ static inline unsigned int pfn_to_color(unsigned long pfn)
  *   request a colored device it is created by this module. The user can then
  *   call mmap on it to access colored memory.
  *
+ * Colored regions can also be created without a device: the control device
+ * gives back an anonymous file that can be mmaped directly. The region
+ * is freed when the file is released (closed and unmapped).
+ *
  * Colored devices are short-lived where as the control one lives as long as the module.
- * Pages allocated to the module are saved in global memory (concurrent access are not handled
- * for now.
+ * Pages allocated to the module are saved in global memory, each color
+ * has its own lock. The list of devices has a lock too.
  * Permission to access the device are not implemented.
  */
 
@@ -78,8 +140,10 @@ static inline unsigned int pfn_to_color(unsigned long pfn)
 #define DEVICES_DEFAULT_VALUE (MKDEV(MAJOR(MAJOR_NUM),MINOR(0)))
 static dev_t devices_id = DEVICES_DEFAULT_VALUE;
 DECLARE_BITMAP(devmap,MAX_DEVICES);
+/* protects devmap and the list of devices */
+static DEFINE_MUTEX(devices_lock);
 
-/* colored devices are created with a fixed size (in pages).
+/* colored devices are created with a size (in pages), they can grow later.
  * Pages allocated to the device are saved into it (for fast retrieval).
  * The struct also contain the colorset associated with this device and
  * the current number of pages associated with the device.
@@ -91,7 +155,15 @@ struct colored_dev {
 	unsigned int nbpages;
 	struct page **pages;
 	unsigned int numcolors;
+	int flags; /* creation flags, see ioctls.h */
+	int node; /* node the pages come from, or IOCTL_NODE_ANY */
+	unsigned int window; /* pages mapped on each fault */
+	color_set cset;
+	unsigned int next; /* color of the next page to add */
+	struct rw_semaphore lock; /* held for writing while pages grow */
+	atomic_long_t faults; /* page faults handled */
 	struct list_head devices;
+	struct list_head live; /* all devices, for statistics */
 };
 
 /* the control device, structure only contains the head of the colored
@@ -103,41 +175,176 @@ struct control_dev {
 
 struct control_dev control;
 
+/* statistics: every device alive, named or anonymous, and the time
+ * spent creating and freeing devices. All protected by stats_lock.
+ */
+static LIST_HEAD(live_devices);
+static DEFINE_MUTEX(stats_lock);
+static unsigned long nbcreated = 0, nbfreed = 0;
+static u64 create_ns = 0, free_ns = 0;
+
 /* Allocated Pages:
  * the kernel module reserves physical memory by making BIG allocations (BIG enough
  * to contain at least a page for each color in the last level cache.
  * Those bigs allocations are called heads and are of size 2**order pages.
+ * To go faster, the module asks for blocks of several heads first, and
+ * smaller ones once the kernel cannot give them anymore.
  *
- * Once reserved, an head is split into pages and a list of all the pages of the same
- * color is saved into a global array.
+ * Once reserved, blocks are sorted by physical address, then split into pages:
+ * a list of all the pages of the same color is saved into a global array,
+ * sorted by physical address once and for all, since the pages of a block
+ * are in order. A bitmap per color tells which pages of the array are free:
+ * allocation takes the free page with the lowest address, a freed page
+ * finds its place in the array by a binary search.
  *
- * Heads need to be saved independently from colors because all heads do not start
+ * Blocks need to be saved independently from colors because all blocks do not start
  * at the same color.
+ *
+ * Each NUMA node reserves its share of the memory, and has its own pages
+ * for each color: a device can ask for pages of a single node. Nodes
+ * reserve their memory at the same time, from one of their cpus.
+ *
+ * The pages of a color on a node and their number are protected by the lock of
+ * their pool: devices using different colors do not wait on each other.
  */
 
-struct page*** pages;
-unsigned int *nbpages;
-struct page* *heads = NULL;
-unsigned int nbheads  = 0;
+/* a pool of pages: all the pages of a color on a node */
+struct color_pool {
+	struct mutex lock;
+	struct page **pages; /* sorted by physical address */
+	unsigned int total; /* size of pages */
+	unsigned long *freemap; /* free pages of the array */
+	unsigned int first; /* no free page before this index */
+	unsigned int nbfree; /* number of free pages */
+	int node;
+};
 
-/* Utils: comparison function for pages.
- * Used to sort physical pages by their addresses.
- * WARNING: we sort pages by decreasing physical number.
+/* pools of each node, indexed by color.
+ * Only nodes with memory have pools. */
+static struct color_pool *pools[MAX_NUMNODES];
+/* held for writing while the pools of a node change size */
+static struct rw_semaphore resize_sems[MAX_NUMNODES];
+/* only one resize at a time */
+static DEFINE_MUTEX(resize_lock);
+/* heads released under memory pressure, protected by resize_lock */
+static unsigned int reclaimed[MAX_NUMNODES];
+
+/* a block of reserved memory, of 2**order pages */
+struct reserved_block {
+	struct page *page;
+	unsigned int order;
+};
+
+/* the memory reserved by a node */
+struct node_reserve {
+	struct work_struct work;
+	int node;
+	unsigned int nbh; /* number of heads to reserve */
+	struct reserved_block *blocks; /* at most nbh */
+	unsigned int nbblocks;
+	int err;
+};
+static struct node_reserve *reserves[MAX_NUMNODES];
+
+/* Utils: comparison function for blocks.
+ * Used to sort physical blocks by their addresses.
  */
-static int cmp_pages(const void *a, const void *b)
+static int cmp_blocks(const void *a, const void *b)
 {
-	struct page *pa, *pb;
 	unsigned long fa,fb;
-	pa = *(struct page **)a;
-	pb = *(struct page **)b;
-	fa = page_to_pfn(pa);
-	fb = page_to_pfn(pb);
+	fa = page_to_pfn(((struct reserved_block *)a)->page);
+	fb = page_to_pfn(((struct reserved_block *)b)->page);
 	if(fa == fb)
 		return 0;
 	else if(fa < fb)
-		return 1;
-	else
 		return -1;
+	else
+		return 1;
+}
+
+/* the pool a page belongs to */
+static inline struct color_pool *page_pool(struct page *page)
+{
+	return &pools[page_to_nid(page)][pfn_to_color(page_to_pfn(page))];
+}
+
+/* index of a page in the array of its pool */
+static unsigned int page_index(struct color_pool *p, struct page *page)
+{
+	unsigned long pfn = page_to_pfn(page);
+	unsigned int lo = 0, hi = p->total, mid;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo)/2;
+		if(page_to_pfn(p->pages[mid]) < pfn)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* takes the free page of lowest address of a pool, NULL if it is empty */
+static struct page *pool_take(struct color_pool *p)
+{
+	unsigned int i;
+	struct page *page = NULL;
+	down_read(&resize_sems[p->node]);
+	mutex_lock(&p->lock);
+	if(p->nbfree > 0)
+	{
+		i = find_next_bit(p->freemap,p->total,p->first);
+		__clear_bit(i,p->freemap);
+		p->nbfree--;
+		p->first = i + 1;
+		page = p->pages[i];
+	}
+	mutex_unlock(&p->lock);
+	up_read(&resize_sems[p->node]);
+	return page;
+}
+
+/* gives a page back to its pool */
+static void pool_give(struct page *page)
+{
+	struct color_pool *p = page_pool(page);
+	unsigned int i;
+	down_read(&resize_sems[p->node]);
+	mutex_lock(&p->lock);
+	i = page_index(p,page);
+	__set_bit(i,p->freemap);
+	p->nbfree++;
+	if(i < p->first)
+		p->first = i;
+	mutex_unlock(&p->lock);
+	up_read(&resize_sems[p->node]);
+}
+
+/* takes a page of a color from a node or, for IOCTL_NODE_ANY,
+ * from the local node first and then from any node that has one.
+ * Returns NULL if there is none.
+ */
+static struct page *take_page(unsigned int color, int node)
+{
+	struct page *page;
+	int n,local;
+	if(node >= 0)
+		return pool_take(&pools[node][color]);
+	local = numa_node_id();
+	if(pools[local] != NULL)
+	{
+		page = pool_take(&pools[local][color]);
+		if(page != NULL)
+			return page;
+	}
+	for_each_node_state(n,N_HIGH_MEMORY)
+		if(n != local && pools[n] != NULL)
+		{
+			page = pool_take(&pools[n][color]);
+			if(page != NULL)
+				return page;
+		}
+	return NULL;
 }
 
 /* Operations for the colored devices:
@@ -147,21 +354,25 @@ static int cmp_pages(const void *a, const void *b)
  */
 
 /* page fault handling. The offset in vmf tell us which page
- * in the array we should return, making a really fast page fault
+ * in the array we should return, making a really fast page fault.
+ * The other pages of the same window are mapped too: first touches
+ * are mostly sequential, this saves the next faults.
  */
 int colored_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	unsigned long offset = 0;
+	unsigned long offset = 0, i, start, end, addr;
 	int ret = VM_FAULT_ERROR, err = 0;
 	struct colored_dev *dev = vma->vm_private_data;
 	struct page * page = NULL;
 	vmf->page = NULL;
 
 	offset =(unsigned int)vmf->pgoff;
+	down_read(&dev->lock);
 	if(offset >= dev->nbpages)
 	{
 		printk(KERN_ERR "ccontrol: dev: %u, offset %lu greater than device size %u.\n",
 			dev->minor,offset,dev->nbpages);
+		up_read(&dev->lock);
 		goto out;
 	}
 
@@ -170,12 +381,55 @@ int colored_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	// insert page into userspace
 	err = vm_insert_page(vma,(unsigned long)vmf->virtual_address,page);
 	if(err)
+	{
+		up_read(&dev->lock);
 		goto out;
+	}
 	ret = VM_FAULT_NOPAGE;
+	atomic_long_inc(&dev->faults);
+
+	// fault around, pages already mapped are just skipped
+	if(dev->window > 1)
+	{
+		start = offset - offset % dev->window;
+		end = start + dev->window;
+		if(start < vma->vm_pgoff)
+			start = vma->vm_pgoff;
+		for(i = start; i < end && i < dev->nbpages; i++)
+		{
+			addr = vma->vm_start + (i - vma->vm_pgoff)*PAGE_SIZE;
+			if(addr >= vma->vm_end)
+				break;
+			if(i != offset)
+				vm_insert_page(vma,addr,dev->pages[i]);
+		}
+	}
+	up_read(&dev->lock);
 out:
 	return ret;
 }
 
+/* maps all the pages of the vma at once, instead of waiting for faults */
+static int colored_populate(struct colored_dev *dev, struct vm_area_struct *vma)
+{
+	unsigned long addr,offset;
+	int err = 0;
+	down_read(&dev->lock);
+	offset = vma->vm_pgoff;
+	for(addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE)
+	{
+		err = vm_insert_page(vma,addr,dev->pages[offset++]);
+		if(err)
+		{
+			printk(KERN_ERR "ccontrol: dev: %u, failed to populate offset %lu.\n",
+				dev->minor,offset-1);
+			break;
+		}
+	}
+	up_read(&dev->lock);
+	return err;
+}
+
 struct vm_operations_struct colored_vm_ops = {
 	.fault = colored_vma_fault,
 };
@@ -191,27 +445,27 @@ int colored_open(struct inode *inode, struct file *filp)
 
 /* on mmap we check some arguments (size and no MAP_SHARED, then
  * we transfer control to vma operations and the struct colored_dev
- * is passed to vma info
+ * is passed to vma info.
+ * An offset is allowed, to map the pages added by a growth.
  */
 int colored_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	struct colored_dev *dev = filp->private_data;
 	size_t size;
-	// check for no offset
-	if(vma->vm_pgoff != 0)
-	{
-		printk(KERN_ERR "ccontrol: no mmap offset is allowed, you asked for %lu.\n",vma->vm_pgoff);
-		return -EPERM;
-	}
+	unsigned int nb;
+	int err;
 
 	// check size is ok
 	size = (vma->vm_end - vma->vm_start)/PAGE_SIZE;
-	printk(KERN_INFO "ccontrol: mmap size %zu, available %u.\n",
-			size, dev->nbpages);
-	if(size > dev->nbpages)
+	down_read(&dev->lock);
+	nb = dev->nbpages;
+	up_read(&dev->lock);
+	printk(KERN_INFO "ccontrol: mmap size %zu at offset %lu, available %u.\n",
+			size, vma->vm_pgoff, nb);
+	if(vma->vm_pgoff > nb || size > nb - vma->vm_pgoff)
 	{
-		printk(KERN_ERR "ccontrol: mmap too big, you asked %zu, available %d.\n",
-			size, dev->nbpages);
+		printk(KERN_ERR "ccontrol: mmap too big, you asked %zu at offset %lu, available %u.\n",
+			size, vma->vm_pgoff, nb);
 		return -ENOMEM;
 	}
 	// check MAP_SHARED is not asked
@@ -222,31 +476,182 @@ int colored_mmap(struct file *filp, struct vm_area_struct *vma)
 	vma->vm_ops = &colored_vm_ops;
 	vma->vm_flags |= VM_RESERVED | VM_CAN_NONLINEAR;
 	vma->vm_private_data = filp->private_data;
+	if(dev->flags & IOCTL_FLAG_POPULATE)
+	{
+		err = colored_populate(dev,vma);
+		if(err)
+			return err;
+	}
 	printk(KERN_INFO "ccontrol: mmap ok\n");
 	return 0;
 }
 
+/* gives the color of each page of the device, as many as the user
+ * array can hold */
+static int dev_colors(struct colored_dev *dev, ioctl_colors *arg)
+{
+	unsigned int i,color;
+	unsigned int __user *colors = (unsigned int __user *)arg->colors;
+	int err = 0;
+	down_read(&dev->lock);
+	for(i = 0; i < dev->nbpages && i < arg->nbpages; i++)
+	{
+		color = pfn_to_color(page_to_pfn(dev->pages[i]));
+		if(put_user(color,colors + i))
+		{
+			err = -EFAULT;
+			goto unlock;
+		}
+	}
+	arg->nbpages = dev->nbpages;
+unlock:
+	up_read(&dev->lock);
+	return err;
+}
+
+static int grow_colored(struct colored_dev *dev, size_t size);
+
+/* handles ioctl on a colored device, see ioctls.h for available values */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+long colored_ioctl(struct file *filp, unsigned int code, unsigned long val)
+#else
+int colored_ioctl(struct inode *inode, struct file *filp, unsigned int code, unsigned long val)
+#endif
+{
+	struct colored_dev *dev = filp->private_data;
+	void __user *argp = (void __user *)val;
+	ioctl_colors local;
+	ioctl_args grow;
+	int err;
+	switch(code) {
+		case IOCTL_FAULT_AROUND:
+			/* change the fault window of the device, val is
+			 * its size in pages
+			 */
+			if(val > MAX_FAULT_AROUND)
+				return -EINVAL;
+			down_write(&dev->lock);
+			dev->window = val;
+			up_write(&dev->lock);
+			break;
+		case IOCTL_COLORS:
+			err = copy_from_user(&local,argp,sizeof(ioctl_colors));
+			if(err)
+			{
+				printk(KERN_ERR "ccontrol: copy_from_user failed %p, errcode : %d\n",argp,err);
+				return -EFAULT;
+			}
+			err = dev_colors(dev,&local);
+			if(err) return err;
+
+			err = copy_to_user(argp,(void *)&local,sizeof(ioctl_colors));
+			if(err)
+			{
+				printk(KERN_ERR "ccontrol: copy_to_user failed %p, errcode : %d\n",argp,err);
+				return -EFAULT;
+			}
+			break;
+		case IOCTL_GROW:
+			/* add pages to the device, the user maps them
+			 * with an offset
+			 */
+			err = copy_from_user(&grow,argp,sizeof(ioctl_args));
+			if(err)
+			{
+				printk(KERN_ERR "ccontrol: copy_from_user failed %p, errcode : %d\n",argp,err);
+				return -EFAULT;
+			}
+			err = grow_colored(dev,grow.size);
+			if(err) return err;
+			break;
+		default:
+			printk(KERN_ERR "ccontrol: invalid opcode %u\n",code);
+			return -EINVAL;
+	}
+	return 0;
+}
+
 static struct file_operations colored_fops = {
 	.owner = THIS_MODULE,
 	.open = colored_open,
 	.mmap = colored_mmap,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	.unlocked_ioctl = colored_ioctl,
+#else
+	.ioctl = colored_ioctl,
+#endif
 };
 
 /* devices helpers:
  */
-int create_colored(struct colored_dev **dev, color_set cset, size_t size)
+
+/* give num more pages to a device, its pages array must be big enough.
+ * Pages are taken in round robin over the device colors.
+ * WARNING: we fail if a single color has not enough pages.
+ * This is intended behavior: we want reproducible allocations, not
+ * something leading to a color to be too much represented (that would
+ * cause unnecessary conflict misses in cache).*/
+static int regrow_memory(int node);
+
+static int take_pages(struct colored_dev *dev, size_t num)
+{
+	size_t got = 0;
+	unsigned int i,start = dev->next;
+	int regrown = 0;
+	struct page *tmp;
+	while(got < num)
+	{
+		i = dev->next;
+		dev->next = (dev->next + 1) % colors;
+		if(!COLOR_ISSET(i,&dev->cset))
+			continue;
+		tmp = take_page(i,dev->node);
+		/* memory released under pressure might be enough */
+		if(tmp == NULL && !regrown)
+		{
+			regrown = 1;
+			if(!regrow_memory(dev->node))
+				tmp = take_page(i,dev->node);
+		}
+		if(tmp == NULL)
+		{
+			printk(KERN_ERR "ccontrol: color %d unavailable\n",i);
+			goto free_pages;
+		}
+		dev->pages[dev->nbpages + got++] = tmp;
+	}
+	dev->nbpages += num;
+	return 0;
+
+free_pages:
+	while(got > 0)
+	{
+		got--;
+		pool_give(dev->pages[dev->nbpages + got]);
+	}
+	dev->next = start;
+	return -ENOMEM;
+}
+
+int create_colored(struct colored_dev **dev, color_set cset, size_t size, int flags,
+		int node)
 {
-	int i;
-	size_t num = 0;
-	unsigned long pfn;
-	struct page * tmp;
 	unsigned int numcolors;
+	ktime_t start = ktime_get();
 	numcolors = COLOR_NUMSET(&cset,colors);
 	if(numcolors == 0)
 	{
 		printk(KERN_ERR "ccontrol: empty color set\n");
 		return -ENOMEM;
 	}
+	/* the local node might have no memory of its own */
+	if(node == IOCTL_NODE_LOCAL)
+		node = pools[numa_node_id()] != NULL ? numa_node_id() : IOCTL_NODE_ANY;
+	if(node != IOCTL_NODE_ANY && (node < 0 || node >= MAX_NUMNODES || pools[node] == NULL))
+	{
+		printk(KERN_ERR "ccontrol: invalid node %d\n",node);
+		return -EINVAL;
+	}
 	/* allocate device */
 	*dev = kmalloc(sizeof(struct colored_dev),GFP_KERNEL);
 	if(*dev == NULL)
@@ -266,45 +671,27 @@ int create_colored(struct colored_dev **dev, color_set cset, size_t size)
 		goto free_dev;
 	}
 	printk(KERN_INFO "ccontrol: allocating %zu pages to new device.\n",size);
+	(*dev)->minor = 0; /* set by the caller for named devices */
 	(*dev)->nbpages = 0;
 	(*dev)->numcolors = numcolors;
-	/* give it pages:
-	 * WARNING: we fail to allocate a device if a single
-	 * color has not enough pages. This is intended behavior:
-	 * we want reproducible allocations, not something leading to
-	 * a color to be too much represented (that would cause unnecessary
-	 * conflict misses in cache).*/
-	while(1)
-	{
-		for(i = 0; i < colors; i++)
-			if(COLOR_ISSET(i,&cset))
-			{
-				if(nbpages[i] > 0)
-				{
-					nbpages[i]--;
-					(*dev)->pages[num++] = pages[i][nbpages[i]];
-					if(num == size)
-						goto out;
-				}
-				else
-				{
-					printk(KERN_ERR "ccontrol: color %d unavailable\n",i);
-					goto free_pages;
-				}
-			}
-	}
-out:
-	(*dev)->nbpages = num;
-	printk(KERN_INFO "ccontrol: new device ready, %zu pages in it.\n",num);
+	(*dev)->flags = flags;
+	(*dev)->node = node;
+	(*dev)->window = fault_around > MAX_FAULT_AROUND ? MAX_FAULT_AROUND : fault_around;
+	(*dev)->cset = cset;
+	(*dev)->next = 0;
+	atomic_long_set(&(*dev)->faults,0);
+	init_rwsem(&(*dev)->lock);
+	if(take_pages(*dev,size))
+		goto free_pages;
+	mutex_lock(&stats_lock);
+	list_add_tail(&(*dev)->live,&live_devices);
+	nbcreated++;
+	create_ns += ktime_to_ns(ktime_sub(ktime_get(),start));
+	mutex_unlock(&stats_lock);
+	printk(KERN_INFO "ccontrol: new device ready, %u pages in it.\n",(*dev)->nbpages);
 	return 0;
 
 free_pages:
-	for(i = num-1; i >= 0; i--)
-	{
-		tmp = (*dev)->pages[i];
-		pfn = page_to_pfn(tmp);
-		pages[pfn_to_color(pfn)][nbpages[pfn_to_color(pfn)]++] = tmp;
-	}
 	vfree((*dev)->pages);
 free_dev:
 	kfree(*dev);
@@ -312,31 +699,86 @@ free_dev:
 	return -ENOMEM;
 }
 
-void free_colored(struct colored_dev *dev)
+/* adds size bytes of pages to a device. The pages array is
+ * reallocated, page faults wait for the growth to be over.
+ */
+static int grow_colored(struct colored_dev *dev, size_t size)
 {
-	/* reclaim pages */
-	unsigned int color,i;
-	unsigned long pfn;
-	printk(KERN_INFO "ccontrol: freeing device with %u pages.\n",dev->nbpages);
+	struct page **old,**new;
+	int err = 0;
+	if(size % PAGE_SIZE != 0)
+		size += PAGE_SIZE - (size % PAGE_SIZE);
+	size = size / PAGE_SIZE;
+	if(size == 0)
+		return 0;
 
-	for(i = 0; i < dev->nbpages; i++)
+	down_write(&dev->lock);
+	new = vmalloc(sizeof(struct page *)*(dev->nbpages + size));
+	if(new == NULL)
 	{
-		pfn = page_to_pfn(dev->pages[i]);
-		color = pfn_to_color(pfn);
-		pages[color][nbpages[color]++] = dev->pages[i];
+		printk(KERN_ERR "ccontrol: vmalloc failed in grow_colored, asked %zu page pointers\n",
+			dev->nbpages + size);
+		err = -ENOMEM;
+		goto unlock;
 	}
-	/* the first numcolors pages are of a different color */
-	for(i = 0; i < dev->numcolors; i++)
+	memcpy(new,dev->pages,sizeof(struct page *)*dev->nbpages);
+	old = dev->pages;
+	dev->pages = new;
+	err = take_pages(dev,size);
+	if(err)
 	{
-		pfn = page_to_pfn(dev->pages[i]);
-		color = pfn_to_color(pfn);
-		sort(pages[color],nbpages[color],sizeof(struct page*),cmp_pages,NULL);
+		dev->pages = old;
+		vfree(new);
+		goto unlock;
 	}
+	vfree(old);
+	printk(KERN_INFO "ccontrol: device %u grew to %u pages.\n",dev->minor,dev->nbpages);
+unlock:
+	up_write(&dev->lock);
+	return err;
+}
+
+void free_colored(struct colored_dev *dev)
+{
+	/* reclaim pages */
+	unsigned int i;
+	ktime_t start = ktime_get();
+	printk(KERN_INFO "ccontrol: freeing device with %u pages.\n",dev->nbpages);
+
+	mutex_lock(&stats_lock);
+	list_del(&dev->live);
+	mutex_unlock(&stats_lock);
+	for(i = 0; i < dev->nbpages; i++)
+		pool_give(dev->pages[i]);
 	/* free device */
 	vfree(dev->pages);
 	kfree(dev);
+	mutex_lock(&stats_lock);
+	nbfreed++;
+	free_ns += ktime_to_ns(ktime_sub(ktime_get(),start));
+	mutex_unlock(&stats_lock);
 }
 
+/* anonymous colored regions: same operations as a colored device,
+ * but the region dies with its file */
+static int anon_release(struct inode *inode, struct file *filp)
+{
+	struct colored_dev *dev = filp->private_data;
+	free_colored(dev);
+	return 0;
+}
+
+static struct file_operations anon_fops = {
+	.owner = THIS_MODULE,
+	.mmap = colored_mmap,
+	.release = anon_release,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	.unlocked_ioctl = colored_ioctl,
+#else
+	.ioctl = colored_ioctl,
+#endif
+};
+
 /* Control device operations:
  * only open, close and ioctl are allowed.
  *
@@ -363,16 +805,23 @@ static int ioctl_new(ioctl_args *arg)
 	unsigned long devid = 0;
 	dev_t devno;
 	printk(KERN_INFO "ccontrol: ioctl, new device asked.\n");
-	/* check a device num is available */
+	/* reserve a device num */
+	mutex_lock(&devices_lock);
 	if(bitmap_full(devmap,MAX_DEVICES))
+	{
+		mutex_unlock(&devices_lock);
 		return -ENOMEM;
+	}
+	devid = find_first_zero_bit(devmap,MAX_DEVICES);
+	set_bit(devid,devmap);
+	mutex_unlock(&devices_lock);
 
 	/* create colored device */
-	err = create_colored(&dev,arg->c, arg->size);
-	if(err) return err;
+	err = create_colored(&dev,arg->c, arg->size, arg->flags, arg->node);
+	if(err)
+		goto clear_devid;
 
 	/* register it */
-	devid = find_first_zero_bit(devmap,MAX_DEVICES);
 	devno = MKDEV(MAJOR(devices_id),MINOR(devices_id) + devid);
 	cdev_init(&dev->cdev,&colored_fops);
 	dev->cdev.owner = THIS_MODULE;
@@ -383,19 +832,25 @@ static int ioctl_new(ioctl_args *arg)
 		/* cleanup device */
 		printk(KERN_ERR "ccontrol: cdev_add failed in ioctl_new, errcode %d\n",err);
 		free_colored(dev);
-		return err;
+		goto clear_devid;
 	}
 
 	/* add it to the list */
-	set_bit(devid,devmap);
 	dev->minor = MINOR(devices_id)+devid;
+	mutex_lock(&devices_lock);
 	list_add(&(dev->devices),&control.devices);
+	mutex_unlock(&devices_lock);
 
 	/* return device number */
 	memset(arg,0,sizeof(ioctl_args));
 	arg->major = MAJOR(devno);
 	arg->minor = MINOR(devno);
 	return 0;
+clear_devid:
+	mutex_lock(&devices_lock);
+	clear_bit(devid,devmap);
+	mutex_unlock(&devices_lock);
+	return err;
 }
 
 
@@ -405,6 +860,7 @@ static int ioctl_free(ioctl_args *arg)
 	struct colored_dev *cur,*tmp;
 	printk(KERN_INFO "ccontrol: ioctl, asked to remove device.\n");
 	/* find colored device */
+	mutex_lock(&devices_lock);
 	list_for_each_entry_safe(cur,tmp,&control.devices,devices)
 	{
 		if(cur->minor == arg->minor)
@@ -414,15 +870,157 @@ static int ioctl_free(ioctl_args *arg)
 			break;
 		}
 	}
+	mutex_unlock(&devices_lock);
 	if(!found)
 	{
 		printk(KERN_ERR "ccontrol: invalid device minor %d\n",arg->minor);
 		return -EINVAL;
 	}
-	/* free it */
+	/* free it, its number can then be reused */
+	cdev_del(&cur->cdev);
 	free_colored(cur);
+	mutex_lock(&devices_lock);
 	clear_bit(arg->minor - MINOR(devices_id),devmap);
+	mutex_unlock(&devices_lock);
+	return 0;
+}
+
+/* creates an anonymous colored region. The file descriptor is only
+ * reserved, it is installed once the user got its number.
+ */
+static int ioctl_new_fd(ioctl_args *arg, struct file **file)
+{
+	int err,fd;
+	struct colored_dev *dev;
+	printk(KERN_INFO "ccontrol: ioctl, new anonymous region asked.\n");
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if(fd < 0)
+		return fd;
+	err = create_colored(&dev,arg->c, arg->size, arg->flags, arg->node);
+	if(err)
+		goto put_fd;
+	dev->minor = 0;
+	*file = anon_inode_getfile("ccontrol",&anon_fops,dev,O_RDWR);
+	if(IS_ERR(*file))
+	{
+		err = PTR_ERR(*file);
+		free_colored(dev);
+		goto put_fd;
+	}
+	memset(arg,0,sizeof(ioctl_args));
+	arg->fd = fd;
 	return 0;
+put_fd:
+	put_unused_fd(fd);
+	return err;
+}
+
+/* batched versions: the user gives an array of ioctl_args */
+static int ioctl_new_batch(ioctl_batch *batch)
+{
+	ioctl_args local;
+	ioctl_args __user *args = (ioctl_args __user *)batch->args;
+	unsigned int i;
+	int err = 0;
+	if(batch->count > IOCTL_MAX_BATCH)
+		return -EINVAL;
+	for(i = 0; i < batch->count; i++)
+	{
+		if(copy_from_user(&local,args + i,sizeof(ioctl_args)))
+		{
+			err = -EFAULT;
+			goto undo;
+		}
+		err = ioctl_new(&local);
+		if(err)
+			goto undo;
+		if(copy_to_user(args + i,&local,sizeof(ioctl_args)))
+		{
+			ioctl_free(&local);
+			err = -EFAULT;
+			goto undo;
+		}
+	}
+	return 0;
+undo:
+	/* the devices already created are in the user array */
+	while(i > 0)
+	{
+		i--;
+		if(copy_from_user(&local,args + i,sizeof(ioctl_args)) == 0)
+			ioctl_free(&local);
+	}
+	return err;
+}
+
+static int ioctl_free_batch(ioctl_batch *batch)
+{
+	ioctl_args local;
+	ioctl_args __user *args = (ioctl_args __user *)batch->args;
+	unsigned int i;
+	int err = 0;
+	if(batch->count > IOCTL_MAX_BATCH)
+		return -EINVAL;
+	/* free as much as we can */
+	for(i = 0; i < batch->count; i++)
+	{
+		if(copy_from_user(&local,args + i,sizeof(ioctl_args)))
+		{
+			err = -EFAULT;
+			continue;
+		}
+		if(ioctl_free(&local))
+			err = -EINVAL;
+	}
+	return err;
+}
+
+/* resizing the pools, defined with the reservation code */
+static int grow_node(int node, unsigned int nbh);
+static unsigned int shrink_node(int node, unsigned int nbh, unsigned int keep);
+
+/* adds or releases memory on a node, or split between all of them.
+ * The size is rounded up to heads, and set to what was really done.
+ */
+static int resize_memory(ioctl_resize *arg, int grow)
+{
+	unsigned long head = PAGE_SIZE << order;
+	unsigned int nbh,done = 0;
+	int n,err = 0;
+	if(arg->node != IOCTL_NODE_ANY && (arg->node < 0 || arg->node >= MAX_NUMNODES
+				|| pools[arg->node] == NULL))
+		return -EINVAL;
+	nbh = (arg->size + head -1) / head;
+	mutex_lock(&resize_lock);
+	if(arg->node != IOCTL_NODE_ANY)
+	{
+		if(grow)
+		{
+			err = grow_node(arg->node,nbh);
+			done = err ? 0 : nbh;
+		}
+		else
+			done = shrink_node(arg->node,nbh,0);
+		goto unlock;
+	}
+	/* each node gets its share */
+	nbh = (nbh + num_node_state(N_HIGH_MEMORY) -1) / num_node_state(N_HIGH_MEMORY);
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		if(grow)
+		{
+			err = grow_node(n,nbh);
+			if(err)
+				break;
+			done += nbh;
+		}
+		else
+			done += shrink_node(n,nbh,0);
+	}
+unlock:
+	mutex_unlock(&resize_lock);
+	arg->size = done * head;
+	return err;
 }
 
 /* handles ioctl on the device, see ioctls.h for available values */
@@ -434,6 +1032,9 @@ int control_ioctl(struct inode *inode, struct file *filp, unsigned int code, uns
 {
 	void __user *argp = (void __user *)val;
 	ioctl_args local;
+	ioctl_batch batch;
+	ioctl_resize resize;
+	struct file *file;
 	int err;
 	switch(code) {
 		case IOCTL_NEW:
@@ -477,6 +1078,70 @@ int control_ioctl(struct inode *inode, struct file *filp, unsigned int code, uns
 			err = ioctl_free(&local);
 			if(err) return err;
 
+			break;
+		case IOCTL_NEW_FD:
+			/* create a new anonymous region: same arguments as
+			 * IOCTL_NEW, a file descriptor is returned
+			 */
+			err = copy_from_user(&local,argp,sizeof(ioctl_args));
+			if(err)
+			{
+				printk(KERN_ERR "ccontrol: copy_from_user failed %p, errcode : %d\n",argp,err);
+				return -EFAULT;
+			}
+			err = ioctl_new_fd(&local,&file);
+			if(err) return err;
+
+			err = copy_to_user(argp,(void *)&local,sizeof(ioctl_args));
+			if(err)
+			{
+				printk(KERN_ERR "ccontrol: copy_to_user failed %p, errcode : %d\n",argp,err);
+				/* the region dies with the file */
+				put_unused_fd(local.fd);
+				fput(file);
+				return -EFAULT;
+			}
+			fd_install(local.fd,file);
+			break;
+		case IOCTL_RESERVE:
+		case IOCTL_RELEASE:
+			/* change the amount of reserved memory, give back
+			 * what was really done */
+			err = copy_from_user(&resize,argp,sizeof(ioctl_resize));
+			if(err)
+			{
+				printk(KERN_ERR "ccontrol: copy_from_user failed %p, errcode : %d\n",argp,err);
+				return -EFAULT;
+			}
+			err = resize_memory(&resize,code == IOCTL_RESERVE);
+			if(copy_to_user(argp,(void *)&resize,sizeof(ioctl_resize)))
+				return -EFAULT;
+			if(err) return err;
+			break;
+		case IOCTL_COLOR_FUNC:
+			err = copy_to_user(argp,(void *)&colorfn,sizeof(ioctl_colorfn));
+			if(err)
+			{
+				printk(KERN_ERR "ccontrol: copy_to_user failed %p, errcode : %d\n",argp,err);
+				return -EFAULT;
+			}
+			break;
+		case IOCTL_NEW_BATCH:
+		case IOCTL_FREE_BATCH:
+			/* same as above, on an array of arguments
+			 */
+			err = copy_from_user(&batch,argp,sizeof(ioctl_batch));
+			if(err)
+			{
+				printk(KERN_ERR "ccontrol: copy_from_user failed %p, errcode : %d\n",argp,err);
+				return -EFAULT;
+			}
+			if(code == IOCTL_NEW_BATCH)
+				err = ioctl_new_batch(&batch);
+			else
+				err = ioctl_free_batch(&batch);
+			if(err) return err;
+
 			break;
 		default:
 			printk(KERN_ERR "ccontrol: invalid opcode %u\n",code);
@@ -495,58 +1160,219 @@ static struct file_operations control_fops = {
 #endif
 };
 
+/* Statistics file, in debugfs: one record per line, a keyword followed
+ * by its values:
+ * color <node> <color> <free pages> <total pages>
+ * device <minor> <node> <pages> <colors> <faults>
+ * devices <number alive>
+ * created|freed <number> <total time in us>
+ * Devices have minor 0 when they are anonymous, and node -1 when their
+ * pages come from any node.
+ */
+static struct dentry *debug_dir = NULL;
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct colored_dev *dev;
+	struct color_pool *p;
+	unsigned int c,nbdevs = 0;
+	int n;
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		down_read(&resize_sems[n]);
+		for(c = 0; c < colors; c++)
+		{
+			p = &pools[n][c];
+			mutex_lock(&p->lock);
+			seq_printf(m,"color %d %u %u %u\n",n,c,p->nbfree,p->total);
+			mutex_unlock(&p->lock);
+		}
+		up_read(&resize_sems[n]);
+	}
+	mutex_lock(&stats_lock);
+	list_for_each_entry(dev,&live_devices,live)
+	{
+		down_read(&dev->lock);
+		seq_printf(m,"device %u %d %u %u %lu\n",dev->minor,dev->node,
+				dev->nbpages,dev->numcolors,atomic_long_read(&dev->faults));
+		up_read(&dev->lock);
+		nbdevs++;
+	}
+	seq_printf(m,"devices %u\n",nbdevs);
+	seq_printf(m,"created %lu %llu\n",nbcreated,(unsigned long long)create_ns/1000);
+	seq_printf(m,"freed %lu %llu\n",nbfreed,(unsigned long long)free_ns/1000);
+	mutex_unlock(&stats_lock);
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp,stats_show,NULL);
+}
+
+static struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
 /* module functions,
  * handle initialization, cleanup, etc
  */
 
-/* allocates the pages and heads arrays,
- * uses the number of heads that will be reserved.
- * NOTE: at most two pages of the same color can appear
- * in an head.
+/* rank of the masks over GF(2), only looking at the bits in low */
+static unsigned int masks_rank(unsigned long *masks, unsigned int n, unsigned long low)
+{
+	unsigned long rows[IOCTL_MAX_COLOR_MASKS],pivot;
+	unsigned int i,j,rank = 0;
+	for(i = 0; i < n; i++)
+		rows[i] = masks[i] & low;
+	for(i = 0; i < n; i++)
+	{
+		if(rows[i] == 0)
+			continue;
+		rank++;
+		pivot = rows[i] & -rows[i];
+		for(j = i+1; j < n; j++)
+			if(rows[j] & pivot)
+				rows[j] ^= rows[i];
+	}
+	return rank;
+}
+
+/* parses the color function parameters and finds the order of heads.
+ * Heads must contain the same number of pages of each color: with a
+ * hash, the bits of pfn inside a head must be enough to produce all
+ * colors.
  */
-int alloc_pagetable(unsigned int nbh)
+static int setup_colors(void)
 {
-	int i;
-	pages = kcalloc(colors,sizeof(struct page**),GFP_KERNEL);
-	if(!pages)
-		return -ENOMEM;
-	nbpages = kcalloc(colors,sizeof(unsigned int),GFP_KERNEL);
-	if(!nbpages)
-		return -ENOMEM;
+	unsigned int i;
+	unsigned long m;
+	colorfn.func = IOCTL_COLOR_MOD;
+	if(!strcmp(color_func,"mod"))
+	{
+		order = get_order(colors*PAGE_SIZE);
+		goto end;
+	}
+	else if(!strcmp(color_func,"bits") && nbmasks == 1)
+	{
+		/* one hash per selected bit */
+		color_type = IOCTL_COLOR_BITS;
+		for(m = color_masks[0]; m != 0 && color_nbits < IOCTL_MAX_COLOR_MASKS; m &= m - 1)
+			color_hash[color_nbits++] = m & -m;
+		if(m != 0)
+			goto invalid;
+	}
+	else if(!strcmp(color_func,"xor") && nbmasks > 0)
+	{
+		color_type = IOCTL_COLOR_XOR;
+		for(i = 0; i < nbmasks; i++)
+			color_hash[i] = color_masks[i];
+		color_nbits = nbmasks;
+	}
+	else
+		goto invalid;
 
-	for(i = 0; i < colors; i++)
+	if(masks_rank(color_hash,color_nbits,~0UL) != color_nbits)
+		goto invalid;
+	colors = 1 << color_nbits;
+	for(order = 0; order < MAX_ORDER; order++)
+		if(masks_rank(color_hash,color_nbits,(1UL << order) -1) == color_nbits)
+			break;
+	if(order == MAX_ORDER)
 	{
-		pages[i] = (struct page **) vmalloc(nbh*2*sizeof(struct page *));
-		if(!pages[i])
-			return -ENOMEM;
+		printk(KERN_ERR "ccontrol: no block of pages has all colors, check color_masks.\n");
+		return -EINVAL;
 	}
+	colorfn.func = color_type;
+	colorfn.nbmasks = nbmasks;
+	for(i = 0; i < nbmasks; i++)
+		colorfn.masks[i] = color_masks[i];
+end:
+	colorfn.colors = colors;
+	per_head = DIV_ROUND_UP(1 << order,colors);
+	return 0;
+invalid:
+	printk(KERN_ERR "ccontrol: invalid color function %s.\n",color_func);
+	return -EINVAL;
+}
 
-	heads = (struct page **) kmalloc(nbh*sizeof(struct page *),GFP_KERNEL);
-	if(!heads)
-		return -ENOMEM;
+/* allocates the pools and blocks arrays,
+ * uses the number of heads that will be reserved on each node.
+ * NOTE: at most per_head pages of the same color can appear
+ * in an head, and bigger blocks are made of heads.
+ */
+int alloc_pagetable(unsigned int nbh)
+{
+	int i,n;
+	struct color_pool *p;
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		init_rwsem(&resize_sems[n]);
+		pools[n] = kcalloc(colors,sizeof(struct color_pool),GFP_KERNEL);
+		if(!pools[n])
+			return -ENOMEM;
+		for(i = 0; i < colors; i++)
+		{
+			p = &pools[n][i];
+			mutex_init(&p->lock);
+			p->node = n;
+			p->pages = (struct page **) vmalloc(nbh*per_head*sizeof(struct page *));
+			if(!p->pages)
+				return -ENOMEM;
+			p->freemap = (unsigned long *) vmalloc(BITS_TO_LONGS(nbh*per_head)*sizeof(unsigned long));
+			if(!p->freemap)
+				return -ENOMEM;
+		}
+	}
 
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		reserves[n] = kzalloc(sizeof(struct node_reserve),GFP_KERNEL);
+		if(!reserves[n])
+			return -ENOMEM;
+		reserves[n]->node = n;
+		reserves[n]->nbh = nbh;
+		reserves[n]->blocks = vmalloc(nbh*sizeof(struct reserved_block));
+		if(!reserves[n]->blocks)
+			return -ENOMEM;
+	}
 	return 0;
 }
 
 /* free in kernel memory used for saving page information.
- * WARNING: this code expects heads to have already been freed.
+ * WARNING: this code expects blocks to have already been freed.
  */
 void clean_pagetable(void)
 {
-	int i;
-	if(heads)
-		kfree((void *)heads);
+	int i,n;
+	for(n = 0; n < MAX_NUMNODES; n++)
+	{
+		if(reserves[n] == NULL)
+			continue;
+		if(reserves[n]->blocks != NULL)
+			vfree((void *)reserves[n]->blocks);
+		kfree((void *)reserves[n]);
+		reserves[n] = NULL;
+	}
 
-	if(pages)
+	for(n = 0; n < MAX_NUMNODES; n++)
 	{
+		if(pools[n] == NULL)
+			continue;
 		for(i = 0; i < colors; i++)
-			if(pages[i] != NULL)
-				vfree((void *)pages[i]);
-		kfree((void *)pages);
+		{
+			if(pools[n][i].pages != NULL)
+				vfree((void *)pools[n][i].pages);
+			if(pools[n][i].freemap != NULL)
+				vfree((void *)pools[n][i].freemap);
+		}
+		kfree((void *)pools[n]);
+		pools[n] = NULL;
 	}
-	if(nbpages)
-		kfree((void *)nbpages);
 }
 
 /* allocates the char device numbers and creates the first device */
@@ -615,59 +1441,474 @@ void clean_devices(void)
 	}
 }
 
-/* reserves physical memory */
-int reserve_memory(unsigned int nbh)
+/* creates the statistics file. Not having debugfs is not an error */
+void alloc_stats(void)
 {
-	int i,j;
-	struct page *page,*nth;
-	unsigned long pfn;
-	unsigned int color;
-	unsigned int nids[MAX_NUMNODES];
-	for(i = 0; i < MAX_NUMNODES; i++)
-		if(node_online(i)) nids[i] = 0;
+	debug_dir = debugfs_create_dir("ccontrol",NULL);
+	if(IS_ERR_OR_NULL(debug_dir)
+		|| IS_ERR_OR_NULL(debugfs_create_file("stats",0444,debug_dir,NULL,&stats_fops)))
+		printk(KERN_INFO "ccontrol: no debugfs, statistics are not available.\n");
+}
 
-	for(i = 0; i < nbh; i++)
+void clean_stats(void)
+{
+	if(!IS_ERR_OR_NULL(debug_dir))
+		debugfs_remove_recursive(debug_dir);
+	debug_dir = NULL;
+}
+
+/* allocates nbh heads on a node, in blocks as big as possible.
+ * Blocks are sorted by physical address. On error, blocks already
+ * allocated are left for the caller to free.
+ */
+static int alloc_blocks(int node, unsigned int nbh, struct reserved_block *blocks,
+		unsigned int *nb)
+{
+	unsigned int o,left = nbh;
+	struct page *page;
+	gfp_t gfp;
+
+	o = MAX_ORDER -1 > order ? MAX_ORDER -1 : order;
+	while(left > 0)
 	{
-		// allocate an head
-		page = alloc_pages(GFP_HIGHUSER | __GFP_COMP,order);
-		if(!page) {
-			printk(KERN_INFO
-				"ccontrol: failed to get a page");
+		/* no more than what is left */
+		while(o > order && (1U << (o - order)) > left)
+			o--;
+		/* big blocks are only a bonus, do not make the kernel work for them */
+		gfp = GFP_HIGHUSER | __GFP_COMP | __GFP_THISNODE;
+		if(o > order)
+			gfp |= __GFP_NORETRY | __GFP_NOWARN;
+		page = alloc_pages_node(node,gfp,o);
+		if(!page)
+		{
+			if(o > order)
+			{
+				o--;
+				continue;
+			}
+			printk(KERN_INFO "ccontrol: failed to get a page on node %d\n",node);
 			return -ENOMEM;
 		}
-		heads[nbheads++] = page;
-		nids[page_to_nid(page)]++;
-		// split the head into colors
-		for(j = 0; j < 1<<order; j++)
+		blocks[*nb].page = page;
+		blocks[*nb].order = o;
+		(*nb)++;
+		left -= 1U << (o - order);
+	}
+	sort(blocks,*nb,sizeof(struct reserved_block),cmp_blocks,NULL);
+	return 0;
+}
+
+/* reserves the heads of a node */
+static int reserve_node(struct node_reserve *r)
+{
+	unsigned int i,j;
+	struct page *nth;
+	struct color_pool *p;
+	int err;
+
+	err = alloc_blocks(r->node,r->nbh,r->blocks,&r->nbblocks);
+	if(err)
+		return err;
+	/* blocks do not overlap: pages come in order, all are free */
+	for(i = 0; i < r->nbblocks; i++)
+		for(j = 0; j < 1U << r->blocks[i].order; j++)
 		{
-			nth = nth_page(page,j);
-			pfn = page_to_pfn(nth);
-			color = pfn_to_color(pfn);
-			pages[color][nbpages[color]++] = nth;
+			nth = nth_page(r->blocks[i].page,j);
+			p = page_pool(nth);
+			p->pages[p->total++] = nth;
 		}
-	}
-	/* sort all pages to improve locality in allocation */
 	for(i = 0; i < colors; i++)
-		sort(pages[i],nbpages[i],sizeof(struct page*),cmp_pages,NULL);
+	{
+		p = &pools[r->node][i];
+		bitmap_zero(p->freemap,per_head*r->nbh);
+		bitmap_fill(p->freemap,p->total);
+		p->nbfree = p->total;
+		p->first = 0;
+	}
+	return 0;
+}
 
-	for(i = 0; i < MAX_NUMNODES; i++)
-		if(node_online(i))
-			printk(KERN_INFO "ccontrol: numa node %d gave us %u blocks\n",i,nids[i]);
+/* merges the sorted new pages of a color into its pool, with arrays
+ * big enough for capacity pages. All new pages are free.
+ * The pools of the node must be locked for writing.
+ */
+static int pool_merge(struct color_pool *p, struct page **add, unsigned int nbadd,
+		unsigned int capacity)
+{
+	struct page **pages;
+	unsigned long *freemap;
+	unsigned int i = 0,j = 0,k = 0;
+	pages = vmalloc(capacity*sizeof(struct page *));
+	freemap = vmalloc(BITS_TO_LONGS(capacity)*sizeof(unsigned long));
+	if(!pages || !freemap)
+	{
+		if(pages)
+			vfree(pages);
+		if(freemap)
+			vfree(freemap);
+		return -ENOMEM;
+	}
+	bitmap_zero(freemap,capacity);
+	while(i < p->total || j < nbadd)
+	{
+		if(j == nbadd || (i < p->total && page_to_pfn(p->pages[i]) < page_to_pfn(add[j])))
+		{
+			if(test_bit(i,p->freemap))
+				__set_bit(k,freemap);
+			pages[k++] = p->pages[i++];
+		}
+		else
+		{
+			__set_bit(k,freemap);
+			pages[k++] = add[j++];
+		}
+	}
+	vfree(p->pages);
+	vfree(p->freemap);
+	p->pages = pages;
+	p->freemap = freemap;
+	p->total = k;
+	p->nbfree += nbadd;
+	p->first = find_first_bit(freemap,k);
+	return 0;
+}
 
+/* is the page inside one of the (sorted) blocks */
+static int in_blocks(struct page *page, struct reserved_block *blocks, unsigned int nb)
+{
+	unsigned long pfn = page_to_pfn(page),start;
+	unsigned int lo = 0, hi = nb, mid;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo)/2;
+		start = page_to_pfn(blocks[mid].page);
+		if(pfn < start)
+			hi = mid;
+		else if(pfn >= start + (1UL << blocks[mid].order))
+			lo = mid + 1;
+		else
+			return 1;
+	}
 	return 0;
 }
 
+/* removes the pages of some free blocks from a pool.
+ * The pools of the node must be locked for writing.
+ */
+static void shrink_pool(struct color_pool *p, struct reserved_block *blocks, unsigned int nb)
+{
+	unsigned int i,k = 0,nbfree = 0;
+	for(i = 0; i < p->total; i++)
+	{
+		if(in_blocks(p->pages[i],blocks,nb))
+			continue;
+		if(test_bit(i,p->freemap))
+		{
+			__set_bit(k,p->freemap);
+			nbfree++;
+		}
+		else
+			__clear_bit(k,p->freemap);
+		p->pages[k++] = p->pages[i];
+	}
+	bitmap_clear(p->freemap,k,p->total - k);
+	p->total = k;
+	p->nbfree = nbfree;
+	p->first = find_first_bit(p->freemap,k);
+}
+
+/* adds nbh heads to a node while devices use it. The pool arrays are
+ * rebuilt, pages of the new blocks merged in address order.
+ */
+static int grow_node(int node, unsigned int nbh)
+{
+	struct node_reserve *r = reserves[node];
+	struct reserved_block *blocks;
+	struct page **add,*nth;
+	unsigned int *nbadd;
+	unsigned int i,j,c,nb = 0,cap = per_head*nbh;
+	int err = -ENOMEM;
+
+	blocks = vmalloc((r->nbblocks + nbh)*sizeof(struct reserved_block));
+	add = vmalloc(colors*cap*sizeof(struct page *));
+	nbadd = kcalloc(colors,sizeof(unsigned int),GFP_KERNEL);
+	if(!blocks || !add || !nbadd)
+		goto free;
+	err = alloc_blocks(node,nbh,blocks + r->nbblocks,&nb);
+	if(err)
+		goto free_blocks;
+	/* new pages of each color, in order */
+	for(i = 0; i < nb; i++)
+		for(j = 0; j < 1U << blocks[r->nbblocks + i].order; j++)
+		{
+			nth = nth_page(blocks[r->nbblocks + i].page,j);
+			c = pfn_to_color(page_to_pfn(nth));
+			add[c*cap + nbadd[c]++] = nth;
+		}
+
+	down_write(&resize_sems[node]);
+	for(c = 0; c < colors; c++)
+	{
+		err = pool_merge(&pools[node][c],add + c*cap,nbadd[c],per_head*(r->nbh + nbh));
+		if(err)
+			break;
+	}
+	if(err)
+	{
+		/* forget the pages already merged, they are all free */
+		while(c > 0)
+		{
+			c--;
+			shrink_pool(&pools[node][c],blocks + r->nbblocks,nb);
+		}
+		up_write(&resize_sems[node]);
+		goto free_blocks;
+	}
+	memcpy(blocks,r->blocks,r->nbblocks*sizeof(struct reserved_block));
+	vfree(r->blocks);
+	r->blocks = blocks;
+	r->nbblocks += nb;
+	r->nbh += nbh;
+	sort(r->blocks,r->nbblocks,sizeof(struct reserved_block),cmp_blocks,NULL);
+	up_write(&resize_sems[node]);
+	printk(KERN_INFO "ccontrol: numa node %d grew by %u heads\n",node,nbh);
+	vfree(add);
+	kfree(nbadd);
+	return 0;
+
+free_blocks:
+	for(i = 0; i < nb; i++)
+		__free_pages(blocks[r->nbblocks + i].page,blocks[r->nbblocks + i].order);
+free:
+	if(blocks)
+		vfree(blocks);
+	if(add)
+		vfree(add);
+	if(nbadd)
+		kfree(nbadd);
+	return err;
+}
+
+/* is every page of a block free */
+static int block_free(struct reserved_block *b)
+{
+	unsigned int j;
+	struct page *nth;
+	struct color_pool *p;
+	for(j = 0; j < 1U << b->order; j++)
+	{
+		nth = nth_page(b->page,j);
+		p = page_pool(nth);
+		if(!test_bit(page_index(p,nth),p->freemap))
+			return 0;
+	}
+	return 1;
+}
+
+/* gives back to the kernel up to nbh heads of a node, only using
+ * blocks with no page used by a device, and keeping at least keep
+ * free pages of each color.
+ * The shrinker calls it during reclaim, so it does not allocate memory:
+ * blocks are released by batches of a fixed size.
+ * Returns the number of heads released.
+ */
+#define SHRINK_BATCH 16
+static unsigned int shrink_node(int node, unsigned int nbh, unsigned int keep)
+{
+	struct node_reserve *r = reserves[node];
+	struct reserved_block gone[SHRINK_BATCH];
+	unsigned int i,k,nb,got,done = 0,heads,minfree;
+
+	do {
+		k = 0;
+		nb = 0;
+		got = 0;
+		minfree = UINT_MAX;
+		down_write(&resize_sems[node]);
+		for(i = 0; i < colors; i++)
+			if(pools[node][i].nbfree < minfree)
+				minfree = pools[node][i].nbfree;
+		/* blocks stay sorted, so do the released ones */
+		for(i = 0; i < r->nbblocks; i++)
+		{
+			heads = 1U << (r->blocks[i].order - order);
+			if(nb < SHRINK_BATCH && done + got + heads <= nbh
+					&& (got + heads)*per_head + keep <= minfree
+					&& block_free(&r->blocks[i]))
+			{
+				gone[nb++] = r->blocks[i];
+				got += heads;
+			}
+			else
+				r->blocks[k++] = r->blocks[i];
+		}
+		if(nb > 0)
+			for(i = 0; i < colors; i++)
+				shrink_pool(&pools[node][i],gone,nb);
+		r->nbblocks = k;
+		r->nbh -= got;
+		up_write(&resize_sems[node]);
+
+		for(i = 0; i < nb; i++)
+			__free_pages(gone[i].page,gone[i].order);
+		done += got;
+	} while(nb == SHRINK_BATCH && done < nbh);
+	if(done > 0)
+		printk(KERN_INFO "ccontrol: numa node %d released %u heads\n",node,done);
+	return done;
+}
+
+/* reserves again the heads released under memory pressure, on a node
+ * or on all of them for IOCTL_NODE_ANY.
+ * Returns 0 if some memory came back.
+ */
+static int regrow_memory(int node)
+{
+	int n,err = -ENOMEM;
+	mutex_lock(&resize_lock);
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		if((node != IOCTL_NODE_ANY && n != node) || reclaimed[n] == 0)
+			continue;
+		if(!regrow)
+		{
+			printk(KERN_ERR "ccontrol: numa node %d released %u heads under memory pressure, not reserving them again\n",
+					n,reclaimed[n]);
+			continue;
+		}
+		if(grow_node(n,reclaimed[n]))
+		{
+			printk(KERN_ERR "ccontrol: numa node %d cannot reserve again the %u heads released under memory pressure\n",
+					n,reclaimed[n]);
+			continue;
+		}
+		reclaimed[n] = 0;
+		err = 0;
+	}
+	mutex_unlock(&resize_lock);
+	return err;
+}
+
+/* memory pressure: the shrinker counts and releases pages of blocks
+ * no device uses. Resizes in progress make it give up, they might be
+ * the ones asking for memory.
+ */
+static int reserve_count(void)
+{
+	int n;
+	unsigned int c,minfree;
+	unsigned long count = 0;
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		minfree = UINT_MAX;
+		for(c = 0; c < colors; c++)
+			if(pools[n][c].nbfree < minfree)
+				minfree = pools[n][c].nbfree;
+		if(minfree > min_per_color)
+			count += ((minfree - min_per_color) / per_head) << order;
+	}
+	return count > INT_MAX ? INT_MAX : count;
+}
+
+/* called with 0 pages to scan to only get the count */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
+static int reserve_shrink(struct shrinker *s, struct shrink_control *sc)
+#else
+static int reserve_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+#endif
+{
+	int n;
+	unsigned int nbh,got,done = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
+	unsigned long nr = sc->nr_to_scan;
+#else
+	unsigned long nr = nr_to_scan;
+#endif
+	if(nr == 0)
+		return reserve_count();
+	if(!mutex_trylock(&resize_lock))
+		return -1;
+	nbh = (nr + (1UL << order) -1) >> order;
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		if(done >= nbh)
+			break;
+		got = shrink_node(n,nbh - done,min_per_color);
+		reclaimed[n] += got;
+		done += got;
+	}
+	mutex_unlock(&resize_lock);
+	return reserve_count();
+}
+
+static struct shrinker reserve_shrinker = {
+	.shrink = reserve_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+static int shrinker_registered = 0;
+
+static void reserve_work(struct work_struct *work)
+{
+	struct node_reserve *r = container_of(work,struct node_reserve,work);
+	r->err = reserve_node(r);
+}
+
+/* reserves physical memory, the heads of each node */
+int reserve_memory(void)
+{
+	int n,err = 0;
+	unsigned int cpu;
+	struct node_reserve *r;
+
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		r = reserves[n];
+		if(!parallel_init)
+		{
+			r->err = reserve_node(r);
+			continue;
+		}
+		/* nodes without cpus use any of them */
+		INIT_WORK(&r->work,reserve_work);
+		cpu = cpumask_first(cpumask_of_node(n));
+		if(cpu < nr_cpu_ids)
+			schedule_work_on(cpu,&r->work);
+		else
+			schedule_work(&r->work);
+	}
+	for_each_node_state(n,N_HIGH_MEMORY)
+	{
+		r = reserves[n];
+		if(parallel_init)
+			flush_work(&r->work);
+		if(r->err)
+			err = r->err;
+		else
+			printk(KERN_INFO "ccontrol: numa node %d gave us %u heads in %u blocks\n",
+					n,r->nbh,r->nbblocks);
+	}
+	return err;
+}
+
 /* frees physical memory */
 void free_memory(void)
 {
-	int i;
-	if(heads)
-		for(i = 0; i < nbheads; i++)
-			__free_pages(heads[i],order);
+	int n;
+	unsigned int i;
+	for(n = 0; n < MAX_NUMNODES; n++)
+		if(reserves[n] != NULL)
+			for(i = 0; i < reserves[n]->nbblocks; i++)
+				__free_pages(reserves[n]->blocks[i].page,reserves[n]->blocks[i].order);
 }
 
 void cleanup(void)
 {
+	if(shrinker_registered)
+	{
+		unregister_shrinker(&reserve_shrinker);
+		shrinker_registered = 0;
+	}
+	clean_stats();
 	clean_devices();
 	free_memory();
 	clean_pagetable();
@@ -676,15 +1917,13 @@ void cleanup(void)
 static int __init init(void)
 {
 	int err = 0;
-	unsigned int blocks;
+	unsigned int blocks,nodes;
+	ktime_t start;
 	printk("ccontrol: started !\n");
-	printk(KERN_INFO "ccontrol: configured with %u colors\n",colors);
-	order = get_order(colors*PAGE_SIZE);
-	if(order < 0)
-	{
-		printk(KERN_ERR "ccontrol: cannot find a good physical page block size.\n");
-		return -EPERM;
-	}
+	err = setup_colors();
+	if(err)
+		return err;
+	printk(KERN_INFO "ccontrol: configured with %u colors, using %s\n",colors,color_func);
 	printk(KERN_INFO "ccontrol: each block is %lu ko wide.\n",(PAGE_SIZE * (1<<order))/1024);
 
 	/* parse mem into a memory size */
@@ -694,8 +1933,11 @@ static int __init init(void)
 	blocks = memory / (PAGE_SIZE * (1<<order));
 	if(blocks * (PAGE_SIZE * (1<<order)) < memory)
 		blocks++;
+	/* each node with memory gets its share */
+	nodes = num_node_state(N_HIGH_MEMORY);
+	blocks = (blocks + nodes -1) / nodes;
 
-	printk(KERN_DEBUG "ccontrol: will allocate %d blocks of order %d.\n",blocks,order);
+	printk(KERN_DEBUG "ccontrol: will allocate %d blocks of order %d on %u nodes.\n",blocks,order,nodes);
 
 	/* clear control struct, this must be done before any errors */
 	memset(&control,0,sizeof(struct control_dev));
@@ -706,13 +1948,23 @@ static int __init init(void)
 		goto error;
 	printk(KERN_DEBUG "ccontrol: pages table correctly allocated.\n");
 
-	err = reserve_memory(blocks);
+	start = ktime_get();
+	err = reserve_memory();
 	if(err)
 		goto error;
+	init_ms = ktime_to_ms(ktime_sub(ktime_get(),start));
+	printk(KERN_INFO "ccontrol: memory reserved in %u ms.\n",init_ms);
 
 	err = alloc_devices();
 	if(err)
 		goto error;
+
+	if(reclaim)
+	{
+		register_shrinker(&reserve_shrinker);
+		shrinker_registered = 1;
+	}
+	alloc_stats();
 	printk("ccontrol: correctly initialized.\n");
 	return 0;
 error:
@@ -12,16 +12,21 @@
 
 #include"config.h"
 #include<ccontrol.h>
+#include<ctype.h>
 #include<errno.h>
 #include<dirent.h>
 #include<fcntl.h>
 #include<getopt.h>
+#include<limits.h>
+#include<sched.h>
+#include<stdint.h>
 #include<stdio.h>
 #include<string.h>
 #include<stdlib.h>
 #include<sys/stat.h>
 #include<sys/types.h>
 #include<sys/wait.h>
+#include<time.h>
 #include<unistd.h>
 
 /* global variables:
@@ -29,13 +34,18 @@
  * size: string to use for CCONTROL_SIZE
  * cset: colorset string to use for CCONTROL_PSET
  * ld: should ld_preload be set in forked environment
+ * domain: LLC domain to run the command on, -1 for none
+ * colorfn: color function of the module, func[:mask,mask...]
  */
 char *mem = "1M";
 char *size = "900K";
+int size_seen = 0;
 char *cset = "1-32";
 int ask_ld = 0;
 int ask_noload = 0;
 int colors_seen = 0;
+long domain = -1;
+char *colorfn = NULL;
 
 static size_t cache_size;
 static unsigned long cache_assoc;
@@ -45,6 +55,12 @@ static unsigned long numcolors;
  * compute LL_NUM_COLORS
  */
 #define SYSPATH "/sys/devices/system/cpu/cpu0/cache"
+/* cache directories also contain other files */
+static int is_index_dir(const struct dirent *d)
+{
+	return !strncmp(d->d_name,"index",5);
+}
+
 static int scan_sys_cache_info(void)
 {
 	int r,i,n;
@@ -60,8 +76,8 @@ static int scan_sys_cache_info(void)
 		return -1;
 	}
 	/* versionsort sort by index number */
-	n = scandir(SYSPATH,&list,0,versionsort);
-	if(n < 0)
+	n = scandir(SYSPATH,&list,is_index_dir,versionsort);
+	if(n <= 0)
 	{
 		perror("scanning sys info cache directory");
 		return -1;
@@ -116,24 +132,207 @@ static int scan_sys_cache_info(void)
 	return 0;
 }
 
+/* LLC domains: the cpus sharing a last level cache.
+ * Each domain has its own cache, and thus its own colors: zones used
+ * by threads of different domains do not compete for the same cache,
+ * even with the same color sets.
+ */
+#define CPUPATH "/sys/devices/system/cpu"
+#define MAX_DOMAINS 256
+#define CPULIST_MAXLEN 1024
+struct llc_domain {
+	char cpus[CPULIST_MAXLEN]; /* shared_cpu_list of the cache */
+	int node; /* NUMA node of the cpus, -1 if unknown */
+	size_t size;
+	unsigned long assoc;
+	unsigned long colors;
+};
+static struct llc_domain domains[MAX_DOMAINS];
+static unsigned int nbdomains = 0;
+
+/* reads the first line of a sysfs file, without its newline */
+static int read_sysfile(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+	char *s;
+	f = fopen(path,"r");
+	if(f == NULL)
+		return -1;
+	s = fgets(buf,len,f);
+	fclose(f);
+	if(s == NULL)
+		return -1;
+	s = strchr(buf,'\n');
+	if(s != NULL)
+		*s = '\0';
+	return 0;
+}
+
+static int is_cpu_dir(const struct dirent *d)
+{
+	return !strncmp(d->d_name,"cpu",3) && isdigit(d->d_name[3]);
+}
+
+static int is_node_link(const struct dirent *d)
+{
+	return !strncmp(d->d_name,"node",4) && isdigit(d->d_name[4]);
+}
+
+static void free_dirlist(struct dirent **list, int n)
+{
+	int i;
+	for(i = 0; i < n; i++)
+		free(list[i]);
+	free(list);
+}
+
+/* scan the last level cache of each cpu, cpus sharing it form a domain */
+static int scan_llc_domains(void)
+{
+	int i,n,m;
+	unsigned int j;
+	struct dirent **cpus,**list;
+	struct llc_domain *d;
+	char path[PATH_MAX],buf[80];
+	long pg_sz;
+
+	pg_sz = sysconf(_SC_PAGESIZE);
+	if(pg_sz == -1)
+	{
+		perror("getting PAGESIZE from sysconf");
+		return -1;
+	}
+	n = scandir(CPUPATH,&cpus,is_cpu_dir,versionsort);
+	if(n < 0)
+	{
+		perror("scanning sysinfo cpu directory");
+		return -1;
+	}
+	nbdomains = 0;
+	for(i = 0; i < n; i++)
+	{
+		/* offline cpus have no cache information */
+		snprintf(path,PATH_MAX,CPUPATH "/%s/cache",cpus[i]->d_name);
+		m = scandir(path,&list,is_index_dir,versionsort);
+		if(m <= 0)
+			continue;
+		snprintf(path,PATH_MAX,CPUPATH "/%s/cache/%s/",cpus[i]->d_name,
+				list[m-1]->d_name);
+		free_dirlist(list,m);
+
+		d = &domains[nbdomains];
+		strncat(path,"shared_cpu_list",PATH_MAX - strlen(path) -1);
+		if(read_sysfile(path,d->cpus,CPULIST_MAXLEN))
+			continue;
+		for(j = 0; j < nbdomains; j++)
+			if(!strcmp(domains[j].cpus,d->cpus))
+				break;
+		if(j < nbdomains)
+			continue;
+		if(nbdomains == MAX_DOMAINS)
+		{
+			fprintf(stderr,"too many LLC domains\n");
+			free_dirlist(cpus,n);
+			return -1;
+		}
+
+		*strrchr(path,'/') = '\0';
+		strncat(path,"/size",PATH_MAX - strlen(path) -1);
+		if(read_sysfile(path,buf,80) || ccontrol_str2size(&d->size,buf))
+			continue;
+		*strrchr(path,'/') = '\0';
+		strncat(path,"/ways_of_associativity",PATH_MAX - strlen(path) -1);
+		if(read_sysfile(path,buf,80))
+			continue;
+		d->assoc = strtoul(buf,NULL,10);
+		if(d->assoc == 0)
+			continue;
+		d->colors = d->size/(pg_sz*d->assoc);
+
+		/* the node of a cpu is a link in its directory */
+		d->node = -1;
+		snprintf(path,PATH_MAX,CPUPATH "/%s",cpus[i]->d_name);
+		m = scandir(path,&list,is_node_link,versionsort);
+		if(m > 0)
+		{
+			d->node = atoi(list[0]->d_name + 4);
+			free_dirlist(list,m);
+		}
+		nbdomains++;
+	}
+	free_dirlist(cpus,n);
+	return 0;
+}
+
+/* parses a cpu list like 0-3,8-11 */
+static int cpulist2set(cpu_set_t *set, const char *list)
+{
+	const char *s = list;
+	char *end;
+	unsigned long a,b;
+	CPU_ZERO(set);
+	while(*s != '\0')
+	{
+		a = strtoul(s,&end,10);
+		if(end == s)
+			return -1;
+		b = a;
+		if(*end == '-')
+		{
+			s = end +1;
+			b = strtoul(s,&end,10);
+			if(end == s || b < a)
+				return -1;
+		}
+		for(; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a,set);
+		s = end;
+		if(*s == ',')
+			s++;
+		else if(*s != '\0')
+			return -1;
+	}
+	return 0;
+}
+
+#define INIT_MS_PATH "/sys/module/ccontrol/parameters/init_ms"
+#define STATS_PATH "/sys/kernel/debug/ccontrol/stats"
 
 /* commands:
  * load: load the kernel module
  * unload: unload the kernel module
  * exec: load, exec binary and unload
  * info: print cache stats
+ * stat: print module statistics
  */
 static int load_module(void)
 {
 	int status;
 	pid_t pid;
-	char argm[80],argc[80];
+	char argm[80],argc[80],argf[80],argk[256],*sep;
+	char *args[7] = { "modprobe", "ccontrol", argm, argc, NULL, NULL, NULL };
+	char buf[80];
 	if(!colors_seen)
 		if(scan_sys_cache_info())
 			return EXIT_FAILURE;
 
 	snprintf(argm,80,"mem=%s",mem);
 	snprintf(argc,80,"colors=%lu",numcolors);
+	if(colorfn != NULL)
+	{
+		/* hashed functions need their masks */
+		sep = strchr(colorfn,':');
+		if(sep != NULL)
+			*sep = '\0';
+		snprintf(argf,80,"color_func=%s",colorfn);
+		args[4] = argf;
+		if(sep != NULL)
+		{
+			snprintf(argk,256,"color_masks=%s",sep+1);
+			args[5] = argk;
+			*sep = ':';
+		}
+	}
 	/* we need to fork to execute modprobe */
 	pid = fork();
 	if(pid == -1)
@@ -141,7 +340,7 @@ static int load_module(void)
 
 	if(!pid)
 	{
-		status = execlp("modprobe","modprobe", "ccontrol",argm,argc,(char *)NULL);
+		status = execvp("modprobe",args);
 		perror("exec modprobe");
 		exit(EXIT_FAILURE);
 	}
@@ -152,6 +351,9 @@ static int load_module(void)
 		return EXIT_FAILURE;
 	}
 	status = WIFEXITED(status) && WEXITSTATUS(status);
+	/* the module tells how long it took to reserve its memory */
+	if(status == 0 && read_sysfile(INIT_MS_PATH,buf,80) == 0)
+		printf("module loaded, memory reserved in %s ms\n",buf);
 	return status;
 }
 
@@ -184,6 +386,18 @@ static int exec_command(char **argv)
 {
 	int status;
 	pid_t pid;
+	cpu_set_t set;
+	char node[80];
+	if(domain != -1)
+	{
+		if(scan_llc_domains())
+			return EXIT_FAILURE;
+		if(domain >= nbdomains)
+		{
+			fprintf(stderr,"no LLC domain %ld\n",domain);
+			return EXIT_FAILURE;
+		}
+	}
 	if(ask_noload)
 		goto fork_command;
 
@@ -199,6 +413,25 @@ fork_command:
 
 	if(!pid)
 	{
+		if(domain != -1)
+		{
+			/* run on the cpus of the domain, with memory of their node */
+			if(cpulist2set(&set,domains[domain].cpus))
+			{
+				fprintf(stderr,"invalid cpu list: %s\n",domains[domain].cpus);
+				exit(EXIT_FAILURE);
+			}
+			if(sched_setaffinity(0,sizeof(cpu_set_t),&set))
+			{
+				perror("setting command affinity");
+				exit(EXIT_FAILURE);
+			}
+			if(ask_ld && domains[domain].node != -1)
+			{
+				snprintf(node,80,"%d",domains[domain].node);
+				setenv(CCONTROL_ENV_NODE,node,1);
+			}
+		}
 		if(ask_ld)
 		{
 			setenv("LD_PRELOAD",CCONTROL_LIB_PATH,1);
@@ -227,9 +460,91 @@ fork_command:
 	return status;
 }
 
+/* grow or shrink the module memory: size [node] */
+static int cmd_resize(int argc, char **argv, int grow)
+{
+	size_t s,asked;
+	int node = CCONTROL_NODE_ANY,err;
+	if(argc < 2 || ccontrol_str2size(&s,argv[1]))
+	{
+		fprintf(stderr,"missing or invalid size\n");
+		return EXIT_FAILURE;
+	}
+	if(argc > 2)
+		node = atoi(argv[2]);
+	asked = s;
+	if(grow)
+		err = ccontrol_reserve_memory(&s,node);
+	else
+		err = ccontrol_release_memory(&s,node);
+	printf("%s %zu bytes of %zu asked\n",grow ? "reserved" : "released",s,asked);
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* print the statistics file of the module, see the module for its format */
+static int cmd_stat(void)
+{
+	FILE *f;
+	char line[256];
+	int node;
+	unsigned int c,nbfree,total,minor,pages,nbcolors;
+	unsigned long faults,count;
+	unsigned long long us;
+	f = fopen(STATS_PATH,"r");
+	if(f == NULL)
+	{
+		perror("opening " STATS_PATH);
+		return EXIT_FAILURE;
+	}
+	while(fgets(line,sizeof(line),f) != NULL)
+	{
+		if(sscanf(line,"color %d %u %u %u",&node,&c,&nbfree,&total) == 4)
+			printf("Node %d color %-8u %u/%u pages free\n",node,c,nbfree,total);
+		else if(sscanf(line,"device %u %d %u %u %lu",&minor,&node,&pages,&nbcolors,&faults) == 5)
+		{
+			if(minor == 0)
+				printf("Anonymous device:     ");
+			else
+				printf("Device %-14u ",minor);
+			if(node < 0)
+				printf("any node, ");
+			else
+				printf("node %d, ",node);
+			printf("%u pages, %u colors, %lu faults\n",pages,nbcolors,faults);
+		}
+		else if(sscanf(line,"devices %u",&c) == 1)
+			printf("Devices alive:        %u\n",c);
+		else if(sscanf(line,"created %lu %llu",&count,&us) == 2)
+			printf("Devices created:      %lu, in %llu us\n",count,us);
+		else if(sscanf(line,"freed %lu %llu",&count,&us) == 2)
+			printf("Devices freed:        %lu, in %llu us\n",count,us);
+	}
+	fclose(f);
+	return EXIT_SUCCESS;
+}
+
+static const char *color_funcs[] = { "mod", "bits", "xor" };
+
+/* print the color function of the loaded module */
+static void print_color_function(void)
+{
+	ioctl_colorfn f;
+	unsigned int i;
+	if(ccontrol_color_function(&f))
+		return;
+	if(f.func < 0 || f.func > IOCTL_COLOR_XOR)
+		return;
+	printf("Module colors:        %u\n",f.colors);
+	printf("Color function:       %s",color_funcs[f.func]);
+	for(i = 0; i < f.nbmasks && i < IOCTL_MAX_COLOR_MASKS; i++)
+		printf("%c%#lx",i ? ',' : ':',f.masks[i]);
+	printf("\n");
+}
+
 static int cmd_info(void)
 {
 	int status;
+	unsigned int i;
 	status = scan_sys_cache_info();
 	if(status != 0)
 	{
@@ -240,6 +555,384 @@ static int cmd_info(void)
 	printf("LLC size:             %zu\n",cache_size);
 	printf("LLC associativity:    %lu\n",cache_assoc);
 	printf("LLC number of colors: %lu\n",numcolors);
+	status = scan_llc_domains();
+	if(status != 0)
+	{
+		fprintf(stderr,"command info failed\n");
+		return status;
+	}
+	if(access(MODULE_CONTROL_DEVICE,F_OK) == 0)
+		print_color_function();
+	printf("LLC domains:\n");
+	for(i = 0; i < nbdomains; i++)
+		printf("domain %u: node %d, %zu bytes, %lu colors, cpus %s\n",i,
+				domains[i].node,domains[i].size,domains[i].colors,
+				domains[i].cpus);
+	return status;
+}
+
+/* calibrate: finds the color function of the machine by timing.
+ * Lines at the same offset of pages of the same color compete for the
+ * same cache set: reading more of them than the cache associativity
+ * evicts the first ones. We find a minimal eviction set for a page,
+ * test every other page against it, and derive the function from the
+ * physical addresses of the pages in conflict. The function is
+ * supposed linear (bits or xor): two pages share a color if the xor of
+ * their pfn is in the kernel of the function.
+ */
+#define CALIBRATE_REPEAT 15
+#define CALIBRATE_RETRIES 3
+#define LONG_BITS (8*sizeof(unsigned long))
+struct cal_page {
+	char *p;
+	unsigned long pfn;
+};
+static struct cal_page *cpages;
+static size_t nbcpages;
+static unsigned long threshold;
+static volatile char sink;
+
+static inline unsigned long now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000000000UL + t.tv_nsec;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* median time to read a page after chasing pointers through a set of
+ * pages, the last one pointing to the page itself */
+static unsigned long chase_time(size_t target, size_t *set, size_t n)
+{
+	unsigned long t[CALIBRATE_REPEAT],start;
+	char * volatile *cur;
+	size_t i,j;
+	for(i = 0; i +1 < n; i++)
+		*(char **)cpages[set[i]].p = cpages[set[i+1]].p;
+	if(n > 0)
+		*(char **)cpages[set[n-1]].p = cpages[target].p;
+	for(i = 0; i < CALIBRATE_REPEAT; i++)
+	{
+		sink = *cpages[target].p;
+		cur = (char * volatile *)(n > 0 ? cpages[set[0]].p : cpages[target].p);
+		for(j = 0; j < n; j++)
+			cur = (char * volatile *)*cur;
+		__sync_synchronize();
+		start = now_ns();
+		sink = *(volatile char *)cur;
+		__sync_synchronize();
+		t[i] = now_ns() - start;
+	}
+	qsort(t,CALIBRATE_REPEAT,sizeof(unsigned long),cmp_ulong);
+	return t[CALIBRATE_REPEAT/2];
+}
+
+static int evicts(size_t target, size_t *set, size_t n)
+{
+	return chase_time(target,set,n) > threshold;
+}
+
+/* time of a read missing the cache: flush it by reading a big buffer */
+static unsigned long miss_time(size_t target)
+{
+	unsigned long t[CALIBRATE_REPEAT],start;
+	size_t i,j,len = 2*cache_size;
+	volatile char *buf;
+	buf = malloc(len);
+	if(buf == NULL)
+		return 0;
+	for(i = 0; i < CALIBRATE_REPEAT; i++)
+	{
+		for(j = 0; j < len; j += 64)
+			buf[j] = j;
+		__sync_synchronize();
+		start = now_ns();
+		sink = *(volatile char *)cpages[target].p;
+		__sync_synchronize();
+		t[i] = now_ns() - start;
+	}
+	free((void *)buf);
+	qsort(t,CALIBRATE_REPEAT,sizeof(unsigned long),cmp_ulong);
+	return t[CALIBRATE_REPEAT/2];
+}
+
+/* physical page numbers of the pool, needs root */
+static int read_pfns(long pg_sz)
+{
+	int fd;
+	size_t i;
+	uint64_t e;
+	fd = open("/proc/self/pagemap",O_RDONLY);
+	if(fd == -1)
+	{
+		perror("opening /proc/self/pagemap");
+		return -1;
+	}
+	for(i = 0; i < nbcpages; i++)
+	{
+		if(pread(fd,&e,sizeof(e),((unsigned long)cpages[i].p/pg_sz)*sizeof(e)) != sizeof(e))
+		{
+			perror("reading /proc/self/pagemap");
+			close(fd);
+			return -1;
+		}
+		cpages[i].pfn = e & ((1ULL << 55) -1);
+		if(!(e >> 63) || cpages[i].pfn == 0)
+		{
+			fprintf(stderr,"physical addresses unavailable, run as root\n");
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/* reduces set to a minimal eviction set of page 0, removing a group
+ * of pages at a time. Returns the size of the set, 0 on failure. */
+static size_t eviction_set(size_t *set, size_t n, size_t *tmp)
+{
+	size_t chunk,k,len,i,m;
+	int removed,retries = 0;
+	if(!evicts(0,set,n))
+		return 0;
+	while(n > cache_assoc)
+	{
+		chunk = (n + cache_assoc) / (cache_assoc + 1);
+		removed = 0;
+		for(k = 0; k < n && !removed; k += chunk)
+		{
+			/* try without this group */
+			len = n - k < chunk ? n - k : chunk;
+			for(i = 0, m = 0; i < n; i++)
+				if(i < k || i >= k + len)
+					tmp[m++] = set[i];
+			if(evicts(0,tmp,m))
+			{
+				memcpy(set,tmp,m*sizeof(size_t));
+				n = m;
+				removed = 1;
+			}
+		}
+		if(removed)
+			retries = 0;
+		else if(++retries > CALIBRATE_RETRIES)
+			return 0;
+	}
+	return n;
+}
+
+static int in_set(size_t page, size_t *set, size_t n)
+{
+	size_t i;
+	for(i = 0; i < n; i++)
+		if(set[i] == page)
+			return 1;
+	return 0;
+}
+
+/* adds a vector to a GF(2) basis indexed by leading bit */
+static int basis_insert(unsigned long *b, unsigned long v)
+{
+	int i;
+	for(i = LONG_BITS -1; i >= 0; i--)
+	{
+		if(!((v >> i) & 1))
+			continue;
+		if(b[i] == 0)
+		{
+			b[i] = v;
+			return 1;
+		}
+		v ^= b[i];
+	}
+	return 0;
+}
+
+/* masks of the color function: the vectors orthogonal to the kernel,
+ * on the bits that vary in the pool. Returns their number. */
+static unsigned int kernel_to_masks(unsigned long *b, unsigned long varying,
+		unsigned long *masks)
+{
+	unsigned int i,j,n = 0;
+	/* reduced echelon form: pivots only appear in their own row */
+	for(i = 0; i < LONG_BITS; i++)
+		if(b[i] != 0)
+			for(j = i+1; j < LONG_BITS; j++)
+				if((b[j] >> i) & 1)
+					b[j] ^= b[i];
+	for(i = 0; i < LONG_BITS; i++)
+	{
+		if(!((varying >> i) & 1) || b[i] != 0)
+			continue;
+		masks[n] = 1UL << i;
+		for(j = 0; j < LONG_BITS; j++)
+			if(b[j] != 0 && ((b[j] >> i) & 1))
+				masks[n] |= 1UL << j;
+		n++;
+	}
+	return n;
+}
+
+static int cmd_calibrate(void)
+{
+	int status = EXIT_FAILURE;
+	struct ccontrol_zone *z;
+	ioctl_colorfn f;
+	color_set c;
+	cpu_set_t cpus;
+	char *pool;
+	size_t i,n,poolsize,*set = NULL,*tmp = NULL,nbcongruent = 0;
+	unsigned long hit,miss,varying = 0,bits = 0;
+	unsigned long kernel[LONG_BITS],masks[LONG_BITS];
+	unsigned int nbmasks;
+	long pg_sz;
+
+	if(scan_sys_cache_info())
+		return EXIT_FAILURE;
+	pg_sz = sysconf(_SC_PAGESIZE);
+	if(access(MODULE_CONTROL_DEVICE,F_OK) != 0)
+	{
+		fprintf(stderr,"module not loaded\n");
+		return EXIT_FAILURE;
+	}
+	if(ccontrol_color_function(&f))
+		return EXIT_FAILURE;
+	/* the pool must hold several eviction sets of each color */
+	poolsize = 4*cache_size;
+	if(size_seen && ccontrol_str2size(&poolsize,size))
+	{
+		fprintf(stderr,"invalid size %s\n",size);
+		return EXIT_FAILURE;
+	}
+	nbcpages = poolsize / pg_sz;
+	if(nbcpages <= 2*cache_assoc)
+	{
+		fprintf(stderr,"size too small\n");
+		return EXIT_FAILURE;
+	}
+
+	/* stay on a single cpu, thus a single cache */
+	CPU_ZERO(&cpus);
+	CPU_SET(sched_getcpu(),&cpus);
+	if(sched_setaffinity(0,sizeof(cpu_set_t),&cpus))
+	{
+		perror("setting affinity");
+		return EXIT_FAILURE;
+	}
+
+	/* a zone with all the colors of the module, aligning the pool on
+	 * a page can take up to two pages more */
+	COLOR_ZERO(&c);
+	for(i = 0; i < f.colors; i++)
+		COLOR_SET(i,&c);
+	z = ccontrol_new();
+	if(z == NULL)
+		return EXIT_FAILURE;
+	if(ccontrol_create_zone_flags(z,&c,ccontrol_memsize2zonesize(1,nbcpages*pg_sz + 2*pg_sz),
+				CCONTROL_ZONE_POPULATE))
+	{
+		fprintf(stderr,"failed to create a zone of %zu pages\n",nbcpages);
+		goto free_zone;
+	}
+	pool = ccontrol_memalign(z,pg_sz,nbcpages*pg_sz);
+	cpages = malloc(nbcpages*sizeof(struct cal_page));
+	set = malloc(nbcpages*sizeof(size_t));
+	tmp = malloc(nbcpages*sizeof(size_t));
+	if(pool == NULL || cpages == NULL || set == NULL || tmp == NULL)
+	{
+		fprintf(stderr,"failed to allocate the page pool\n");
+		goto free_all;
+	}
+	for(i = 0; i < nbcpages; i++)
+	{
+		cpages[i].p = pool + i*pg_sz;
+		*cpages[i].p = 0;
+	}
+	if(read_pfns(pg_sz))
+		goto free_all;
+
+	/* the limit between a cache hit and a miss */
+	for(i = 0; i < cache_assoc/2; i++)
+		set[i] = i+1;
+	hit = chase_time(0,set,cache_assoc/2);
+	miss = miss_time(0);
+	threshold = (hit + miss)/2;
+	printf("hit: %luns, miss: %luns\n",hit,miss);
+	if(miss <= hit)
+	{
+		fprintf(stderr,"cannot distinguish cache misses\n");
+		goto free_all;
+	}
+
+	/* a minimal set of pages evicting page 0 */
+	for(i = 0; i < nbcpages -1; i++)
+		set[i] = i+1;
+	n = eviction_set(set,nbcpages -1,tmp);
+	if(n == 0)
+	{
+		fprintf(stderr,"no eviction set found, try a bigger --size\n");
+		goto free_all;
+	}
+	printf("eviction set of %zu pages\n",n);
+
+	/* pages of the same color as page 0 are evicted by the set */
+	memset(kernel,0,sizeof(kernel));
+	for(i = 0; i < nbcpages; i++)
+		varying |= cpages[i].pfn ^ cpages[0].pfn;
+	for(i = 0; i < n; i++)
+		basis_insert(kernel,cpages[set[i]].pfn ^ cpages[0].pfn);
+	for(i = 1; i < nbcpages; i++)
+		if(!in_set(i,set,n) && evicts(i,set,n))
+		{
+			nbcongruent++;
+			basis_insert(kernel,cpages[i].pfn ^ cpages[0].pfn);
+		}
+	if(nbcongruent == 0)
+	{
+		fprintf(stderr,"no page in conflict found\n");
+		goto free_all;
+	}
+
+	nbmasks = kernel_to_masks(kernel,varying,masks);
+	/* page 0 and its eviction set also have the same color */
+	nbcongruent += n + 1;
+	printf("pages in conflict: %zu of %zu, about %zu colors\n",nbcongruent,
+			nbcpages,nbcpages/nbcongruent);
+	printf("pfn bits tested: %#lx\n",varying);
+	printf("effective colors: %lu\n",nbmasks < LONG_BITS ? 1UL << nbmasks : 0);
+	if(nbmasks == 0 || nbmasks > IOCTL_MAX_COLOR_MASKS)
+	{
+		fprintf(stderr,"no usable color function found\n");
+		goto free_all;
+	}
+	/* single bit masks are a bit selection */
+	for(i = 0; i < nbmasks; i++)
+	{
+		if(masks[i] & (masks[i] -1))
+			break;
+		bits |= masks[i];
+	}
+	printf("configuration: ccontrol load --color-func ");
+	if(i == nbmasks)
+		printf("bits:%#lx\n",bits);
+	else
+		for(i = 0; i < nbmasks; i++)
+			printf("%s%#lx%s",i ? "" : "xor:",masks[i],i +1 < nbmasks ? "," : "\n");
+	status = 0;
+free_all:
+	free(set);
+	free(tmp);
+	free(cpages);
+	ccontrol_destroy_zone(z);
+free_zone:
+	ccontrol_delete(z);
 	return status;
 }
 
@@ -256,15 +949,24 @@ void print_help()
 	printf("--version,-h            : print program version\n");
 	printf("--mem,-m <string>       : mem argument of the module\n");
 	printf("--size,-s <string>      : CCONTROL_SIZE value\n");
-	printf("--pset,-p <string>      : CCONTROL_PSET value\n");
+	printf("--pset,-p <string>      : CCONTROL_PSET value, use ':' to give\n");
+	printf("                          each thread its own color set\n");
 	printf("--colors,-c <uint>      : colors argument of the module value\n");
 	printf("--ld-preload,-l         : set LD_PRELOAD before exec\n");
 	printf("--no-load,-n            : don't load module before exec\n");
+	printf("--domain,-d <uint>      : run the command on a LLC domain (see info)\n");
+	printf("--color-func,-f <string>: color function of the module, mod (default),\n");
+	printf("                          bits:<mask> or xor:<mask>,<mask>... on pfn bits\n");
 	printf("Available commands:\n");
 	printf("load                    : load kernel module\n");
 	printf("unload                  : unload kernel module\n");
 	printf("exec <args>             : execute args\n");
 	printf("info                    : print cache information\n");
+	printf("grow <size> [node]      : reserve more memory in the module\n");
+	printf("shrink <size> [node]    : give unused module memory back\n");
+	printf("stat                    : print free pages and devices of the module\n");
+	printf("calibrate               : find the color function by timing,\n");
+	printf("                          on a pool of --size bytes\n");
 }
 
 /* command line arguments */
@@ -277,10 +979,12 @@ static struct option long_options[] = {
 	{ "pset", required_argument, NULL, 'p' },
 	{ "size", required_argument, NULL, 's' },
 	{ "colors", required_argument, NULL, 'c' },
+	{ "domain", required_argument, NULL, 'd' },
+	{ "color-func", required_argument, NULL, 'f' },
 	{ 0, 0 , 0, 0},
 };
 
-static const char* short_opts ="hVlnm:p:s:c:";
+static const char* short_opts ="hVlnm:p:s:c:d:f:";
 
 int main(int argc, char *argv[])
 {
@@ -308,6 +1012,18 @@ int main(int argc, char *argv[])
 				}
 				colors_seen = 1;
 				break;
+			case 'd':
+				errno = 0;
+				domain = strtol(optarg,(char **)NULL,0);
+				if(errno || domain < 0)
+				{
+					fprintf(stderr,"invalid domain: %s\n",optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'f':
+				colorfn = optarg;
+				break;
 			case 'm':
 				mem = optarg;
 				break;
@@ -328,6 +1044,7 @@ int main(int argc, char *argv[])
 				break;
 			case 's':
 				size = optarg;
+				size_seen = 1;
 				break;
 			default:
 				fprintf(stderr,
@@ -353,6 +1070,21 @@ int main(int argc, char *argv[])
 		print_help();
 		exit(EXIT_SUCCESS);
 	}
+	if(!strcmp(argv[0],"grow") || !strcmp(argv[0],"shrink"))
+	{
+		status = cmd_resize(argc,argv,!strcmp(argv[0],"grow"));
+		goto end;
+	}
+	if(!strcmp(argv[0],"stat"))
+	{
+		status = cmd_stat();
+		goto end;
+	}
+	if(!strcmp(argv[0],"calibrate"))
+	{
+		status = cmd_calibrate();
+		goto end;
+	}
 	if(!strcmp(argv[0],"info"))
 	{
 		status = cmd_info();
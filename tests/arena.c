@@ -0,0 +1,74 @@
+/* arena zones: bump allocation, free of the last block, rewind to
+ * a mark and realloc */
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include<ccontrol.h>
+
+int main()
+{
+	struct ccontrol_zone *z;
+	color_set c;
+	char *a,*b,*d,*e;
+	size_t mark;
+	int i;
+	COLOR_ZERO(&c);
+	for(i = 0; i < 32; i++)
+		COLOR_SET(i,&c);
+
+	z = ccontrol_new();
+	assert(z != NULL);
+	i = ccontrol_create_zone_flags(z,&c,1<<16,CCONTROL_ZONE_ARENA);
+	assert(i == 0);
+
+	/* allocations follow each other */
+	fprintf(stderr,"arena:test bump\n");
+	a = ccontrol_malloc(z,100);
+	b = ccontrol_malloc(z,100);
+	assert(a != NULL && b != NULL);
+	assert(b >= a + 100);
+	memset(a,'a',100);
+	memset(b,'b',100);
+
+	/* only the last allocation can be freed */
+	fprintf(stderr,"arena:test free last\n");
+	ccontrol_free(z,b);
+	d = ccontrol_malloc(z,100);
+	assert(d == b);
+	ccontrol_free(z,a);
+	e = ccontrol_malloc(z,10);
+	assert(e > d);
+
+	/* rewind frees everything allocated after the mark */
+	fprintf(stderr,"arena:test rewind\n");
+	mark = ccontrol_arena_mark(z);
+	b = ccontrol_malloc(z,1000);
+	assert(b != NULL);
+	assert(ccontrol_malloc(z,1000) != NULL);
+	ccontrol_arena_rewind(z,mark);
+	d = ccontrol_malloc(z,1000);
+	assert(d == b);
+
+	/* the top grows in place, other blocks move */
+	fprintf(stderr,"arena:test realloc\n");
+	memset(d,'d',1000);
+	b = ccontrol_realloc(z,d,5000);
+	assert(b == d);
+	for(i = 0; i < 1000; i++)
+		assert(b[i] == 'd');
+	e = ccontrol_realloc(z,a,300);
+	assert(e != NULL && e != a && e >= b + 5000);
+	for(i = 0; i < 100; i++)
+		assert(e[i] == 'a');
+	d = ccontrol_malloc(z,1);
+	assert(d >= e + 300);
+
+	/* bigger than the zone */
+	assert(ccontrol_malloc(z,(size_t)1<<30) == NULL);
+
+	ccontrol_destroy_zone(z);
+	ccontrol_delete(z);
+	return 0;
+}
@@ -6,18 +6,49 @@
 #include<string.h>
 #include<assert.h>
 
+/* page filters for the page restricted allocations */
+static int even_page(void *arg, size_t i)
+{
+	return i % 2 == 0;
+}
+
+static int odd_page(void *arg, size_t i)
+{
+	return i % 2 == 1;
+}
+
+/* tells if all the bytes of an allocation are in allowed pages */
+static int in_pages(void *z, void *p, size_t size, size_t pgsize,
+		int (*ok)(void *, size_t))
+{
+	size_t i;
+	for(i = 0; i < size; i++)
+		if(!ok(NULL,((char *)p + i - (char *)z) / pgsize))
+			return 0;
+	return 1;
+}
+
 int main()
 {
 	void *a,*b,*c;
-	char t[500];
+	void *all[64];
+	int i,n;
+	/* zones for extend and page restricted init */
+	static char t2[4096] __attribute__((aligned(FL_ALIGN)));
+	void *mem2 = (void *)&t2[0];
+	/* a zone of pages, like the one of ccontrol calibrate */
+	static char t3[20*4096] __attribute__((aligned(4096)));
+	void *mem3 = (void *)&t3[0];
+	/* fl_init needs a zone aligned on FL_ALIGN */
+	static char t[1024] __attribute__((aligned(FL_ALIGN)));
 	void *mem = (void *)&t[0];
-	size_t size = 500, max = 500 -ALLOCATOR_OVERHEAD;
+	size_t size = 1024, max = 1024 -ALLOCATOR_OVERHEAD;
 	fprintf(stderr,"sizeof(size_t): %u\n",sizeof(size_t));
 	fprintf(stderr,"sizeof(fl): %u\n",sizeof(fl));
 	fprintf(stderr,"fl:size is %u, max should be %u\n",size,max);
-	fl_init(mem,500);
+	fl_init(mem,size);
 
-	/* we don't have exactly 500 bytes available
+	/* we don't have exactly 1024 bytes available
 	 * because of allocator overhead */
 	fprintf(stderr,"fl:test too big\n");
 	a = fl_allocate(mem,size);
@@ -49,18 +80,121 @@ int main()
 
 	/* alloc 3, free the middle one and realloc it */
 	fprintf(stderr,"fl:test middle free\n");
-	b = fl_allocate(mem,max-440);
+	b = fl_allocate(mem,max-460);
 	assert(b != NULL);
-	memset(b,'b',max -440);
+	memset(b,'b',max -460);
 	c = fl_allocate(mem,20);
 	assert(c != NULL);
 	memset(c,'c',20);
 	fl_free(mem,b);
-	b = fl_allocate(mem,max-440);
+	b = fl_allocate(mem,max-460);
 	assert(b != NULL);
-	memset(b,'b',max -440);
+	memset(b,'b',max -460);
 	fl_free(mem,a);
 	fl_free(mem,b);
 	fl_free(mem,c);
+
+	/* freed neighbours must have been merged back */
+	fprintf(stderr,"fl:test merge on free\n");
+	a = fl_allocate(mem,max);
+	assert(a != NULL);
+	memset(a,'a',max);
+	fl_free(mem,a);
+
+	/* realloc should grow and shrink in place when it can */
+	fprintf(stderr,"fl:test realloc in place\n");
+	a = fl_allocate(mem,100);
+	assert(a != NULL);
+	memset(a,'a',100);
+	b = fl_realloc(mem,a,max);
+	assert(b == a);
+	for(i = 0; i < 100; i++)
+		assert(((char *)b)[i] == 'a');
+	b = fl_realloc(mem,a,100);
+	assert(b == a);
+	c = fl_allocate(mem,200);
+	assert(c != NULL);
+	fl_free(mem,b);
+	fl_free(mem,c);
+
+	/* aligned allocations give back the memory around them */
+	fprintf(stderr,"fl:test memalign\n");
+	a = fl_memalign(mem,64,100);
+	assert(a != NULL && ((size_t)a & 63) == 0);
+	assert(fl_usable_size(a) >= 100);
+	b = fl_memalign(mem,128,10);
+	assert(b != NULL && ((size_t)b & 127) == 0);
+	fl_free(mem,a);
+	fl_free(mem,b);
+	a = fl_allocate(mem,max);
+	assert(a != NULL);
+	fl_free(mem,a);
+
+	/* rejected pages are never given */
+	fprintf(stderr,"fl:test allocate pages\n");
+	for(n = 0; n < 64; n++)
+	{
+		all[n] = fl_allocate_pages(mem,40,128,even_page,NULL);
+		if(all[n] == NULL)
+			break;
+		assert(in_pages(mem,all[n],40,128,even_page));
+		memset(all[n],'a',40);
+	}
+	assert(n > 0 && n < 64);
+	while(n > 0)
+		fl_free(mem,all[--n]);
+	a = fl_allocate(mem,max);
+	assert(a != NULL);
+	fl_free(mem,a);
+
+	/* extended memory merges with the free block at the end */
+	fprintf(stderr,"fl:test extend\n");
+	fl_init(mem2,1024);
+	a = fl_allocate(mem2,100);
+	assert(a != NULL);
+	assert(fl_allocate(mem2,1200) == NULL);
+	assert(fl_extend(mem2,1024,2048) == 0);
+	b = fl_allocate(mem2,1200);
+	assert(b != NULL && (char *)b < (char *)mem2 + 1024);
+	memset(b,'b',1200);
+	fl_free(mem2,a);
+	fl_free(mem2,b);
+	a = fl_allocate(mem2,2048 - ALLOCATOR_OVERHEAD);
+	assert(a != NULL);
+	fl_free(mem2,a);
+
+	/* the first page is rejected, only odd pages can be used */
+	fprintf(stderr,"fl:test init pages\n");
+	assert(fl_init_pages(mem2,4096,1024,odd_page,NULL) == 0);
+	for(n = 0; n < 64; n++)
+	{
+		all[n] = fl_allocate(mem2,100);
+		if(all[n] == NULL)
+			break;
+		assert(in_pages(mem2,all[n],100,1024,odd_page));
+		memset(all[n],'a',100);
+	}
+	assert(n > 0 && n < 64);
+	while(n > 0)
+		fl_free(mem2,all[--n]);
+	/* each usable page is still a single block */
+	a = fl_allocate(mem2,900);
+	b = fl_allocate(mem2,900);
+	assert(a != NULL && in_pages(mem2,a,900,1024,odd_page));
+	assert(b != NULL && in_pages(mem2,b,900,1024,odd_page));
+	assert(fl_allocate(mem2,900) == NULL);
+	fl_free(mem2,a);
+	fl_free(mem2,b);
+
+	/* page aligned memory fits a zone sized like
+	 * ccontrol_memsize2zonesize(1,size + 2*page) does */
+	fprintf(stderr,"fl:test memalign in a tight zone\n");
+	size = (16*4096 + 2*4096 + ALLOCATOR_OVERHEAD + ALIGN_MASK + FL_MINSIZE -1) & ~ALIGN_MASK;
+	assert(size <= sizeof(t3));
+	fl_init(mem3,size);
+	a = fl_memalign(mem3,4096,16*4096);
+	assert(a != NULL && ((size_t)a & 4095) == 0);
+	memset(a,'a',16*4096);
+	fl_free(mem3,a);
 	return 0;
 }
@@ -0,0 +1,86 @@
+/* object pools: packing, reuse of freed objects, alignment and
+ * smaller slabs when the zone is almost full */
+#include<assert.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include<ccontrol.h>
+
+#define NBOBJS 10000
+#define CHUNK (32*1024)
+
+static void *objs[NBOBJS];
+static void *chunks[4096];
+
+int main()
+{
+	struct ccontrol_zone *z;
+	struct ccontrol_pool *p;
+	color_set c;
+	char *a,*b;
+	int i,n;
+	COLOR_ZERO(&c);
+	for(i = 0; i < 32; i++)
+		COLOR_SET(i,&c);
+
+	z = ccontrol_new();
+	assert(z != NULL);
+	i = ccontrol_create_zone(z,&c,1<<20);
+	assert(i == 0);
+
+	/* small objects are packed */
+	fprintf(stderr,"pool:test packing\n");
+	p = ccontrol_pool_create(z,24,0);
+	assert(p != NULL);
+	a = ccontrol_pool_alloc(p);
+	b = ccontrol_pool_alloc(p);
+	assert(a != NULL && b == a + 24);
+
+	/* many objects, all different, freed ones are reused */
+	fprintf(stderr,"pool:test alloc free\n");
+	for(i = 0; i < NBOBJS; i++)
+	{
+		objs[i] = ccontrol_pool_alloc(p);
+		assert(objs[i] != NULL);
+		memset(objs[i],i,24);
+	}
+	for(i = 0; i < NBOBJS; i++)
+		assert(((char *)objs[i])[23] == (char)i);
+	ccontrol_pool_free(p,objs[42]);
+	assert(ccontrol_pool_alloc(p) == objs[42]);
+	ccontrol_pool_destroy(p);
+
+	/* alignment asked by the user */
+	fprintf(stderr,"pool:test align\n");
+	p = ccontrol_pool_create(z,24,64);
+	assert(p != NULL);
+	for(i = 0; i < 100; i++)
+	{
+		a = ccontrol_pool_alloc(p);
+		assert(a != NULL && ((size_t)a & 63) == 0);
+	}
+	ccontrol_pool_destroy(p);
+
+	/* less than a full slab left in the zone */
+	fprintf(stderr,"pool:test small slabs\n");
+	for(n = 0; n < 4096; n++)
+	{
+		chunks[n] = ccontrol_malloc(z,CHUNK);
+		if(chunks[n] == NULL)
+			break;
+	}
+	assert(n > 0 && n < 4096);
+	ccontrol_free(z,chunks[--n]);
+	assert(ccontrol_malloc(z,2*CHUNK) == NULL);
+	p = ccontrol_pool_create(z,24,0);
+	assert(p != NULL);
+	assert(ccontrol_pool_alloc(p) != NULL);
+	ccontrol_pool_destroy(p);
+	while(n > 0)
+		ccontrol_free(z,chunks[--n]);
+
+	ccontrol_destroy_zone(z);
+	ccontrol_delete(z);
+	return 0;
+}
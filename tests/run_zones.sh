@@ -0,0 +1,10 @@
+#!/bin/sh
+# zone tests, with the kernel module loaded
+set -e -u
+path=$srcdir/../src/utils
+$path/ccontrol load -m 16M
+./threads
+./arena
+./pool
+LD_PRELOAD=../src/lib/.libs/libccontrol-malloc.so CCONTROL_PSET=0-31 CCONTROL_SIZE=8M ./shim
+$path/ccontrol unload
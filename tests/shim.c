@@ -0,0 +1,37 @@
+/* the malloc library preloaded in a threaded program:
+ * thread creation itself allocates memory */
+#include<assert.h>
+#include<pthread.h>
+#include<stdlib.h>
+#include<string.h>
+
+#define NBTHREADS 4
+
+static void *worker(void *arg)
+{
+	unsigned int i,j;
+	char *p;
+	for(i = 0; i < 1000; i++)
+	{
+		p = calloc(1 + i % 100,8);
+		assert(p != NULL);
+		for(j = 0; j < 8*(1 + i % 100); j++)
+			assert(p[j] == 0);
+		p = realloc(p,200);
+		assert(p != NULL);
+		memset(p,'a',200);
+		free(p);
+	}
+	return NULL;
+}
+
+int main()
+{
+	pthread_t threads[NBTHREADS];
+	int i;
+	for(i = 0; i < NBTHREADS; i++)
+		assert(pthread_create(&threads[i],NULL,worker,NULL) == 0);
+	for(i = 0; i < NBTHREADS; i++)
+		pthread_join(threads[i],NULL);
+	return 0;
+}
@@ -0,0 +1,85 @@
+/* thread-safe zones: concurrent allocations, frees from other threads
+ * and zone destruction while threads still have a cache on it */
+#include<assert.h>
+#include<pthread.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#include<ccontrol.h>
+
+#define NBTHREADS 4
+#define NBALLOCS 1000
+
+static struct ccontrol_zone *z;
+static char *blocks[NBTHREADS][NBALLOCS];
+static pthread_barrier_t allocated, freed, destroyed;
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	unsigned int i,size;
+	char *p;
+	/* allocate, free half of it and give the rest to another thread */
+	for(i = 0; i < NBALLOCS; i++)
+	{
+		size = 8 + (i*7) % 400;
+		p = ccontrol_malloc(z,size);
+		assert(p != NULL);
+		memset(p,(char)id,size);
+		blocks[id][i] = p;
+		if(i % 2 == 0)
+			continue;
+		p = blocks[id][i-1];
+		assert(p[0] == (char)id);
+		ccontrol_free(z,p);
+		blocks[id][i-1] = NULL;
+	}
+	pthread_barrier_wait(&allocated);
+	id = (id + 1) % NBTHREADS;
+	for(i = 1; i < NBALLOCS; i += 2)
+	{
+		p = blocks[id][i];
+		assert(p[0] == (char)id);
+		ccontrol_free(z,p);
+	}
+	pthread_barrier_wait(&freed);
+	/* our cache is still attached to the zone */
+	pthread_barrier_wait(&destroyed);
+	return NULL;
+}
+
+int main()
+{
+	pthread_t threads[NBTHREADS];
+	color_set c;
+	long i;
+	void *p;
+	COLOR_ZERO(&c);
+	for(i = 0; i < 32; i++)
+		COLOR_SET(i,&c);
+
+	z = ccontrol_new();
+	assert(z != NULL);
+	i = ccontrol_create_zone_flags(z,&c,1<<20,CCONTROL_ZONE_THREADSAFE);
+	assert(i == 0);
+	pthread_barrier_init(&allocated,NULL,NBTHREADS);
+	pthread_barrier_init(&freed,NULL,NBTHREADS+1);
+	pthread_barrier_init(&destroyed,NULL,NBTHREADS+1);
+	for(i = 0; i < NBTHREADS; i++)
+		assert(pthread_create(&threads[i],NULL,worker,(void *)i) == 0);
+	pthread_barrier_wait(&freed);
+
+	/* the main thread attaches its own cache */
+	p = ccontrol_malloc(z,100);
+	assert(p != NULL);
+	ccontrol_free(z,p);
+
+	/* threads exit after the zone is gone */
+	assert(ccontrol_destroy_zone(z) == 0);
+	ccontrol_delete(z);
+	pthread_barrier_wait(&destroyed);
+	for(i = 0; i < NBTHREADS; i++)
+		pthread_join(threads[i],NULL);
+	return 0;
+}